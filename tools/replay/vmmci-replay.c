@@ -0,0 +1,320 @@
+/*
+ *  vmmci-replay - run recorded drift samples through the vmmci sync core
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Reads a trace of drift samples, as found in the driver's debugfs samples
+ * file or written by vmmcid -t, and replays it against the same policy
+ * code the driver runs. Each line is:
+ *
+ *   host real mono raw boot cycles offset width
+ *
+ * separated by spaces or commas, with '#' starting a comment.
+ *
+ * Since the raw clock is never stepped or slewed, host less raw gives us
+ * the guest's free running error. We simulate our own corrections on top
+ * of that, so the trace doesn't need to come from a guest running the
+ * parameters being tried.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "virtio_vmmci_core.h"
+
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_SEC	1000000000LL
+
+/* Fastest the kernel will slew the clock, in ppm (see adjtime(3)) */
+#define SLEW_MAX_PPM	500
+
+/* Most points we'll fit our frequency estimate over */
+#define MAX_WINDOW	1024
+
+struct trace_sample {
+	s64 host, real, mono, raw, boot;
+	u64 cycles;
+	s64 offset, width;
+};
+
+static int verbose = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: vmmci-replay [-v] [-a autostep ms] "
+	    "[-c confirm] [-i interval s] [-s slew us] [-t threshold ms] "
+	    "[-w window] [trace]\n");
+	exit(1);
+}
+
+static long long
+number(const char *s, long long min, long long max)
+{
+	char *end;
+	long long v;
+
+	errno = 0;
+	v = strtoll(s, &end, 10);
+	if (errno || *s == '\0' || *end != '\0' || v < min || v > max) {
+		fprintf(stderr, "vmmci-replay: bad number: %s\n", s);
+		exit(1);
+	}
+	return v;
+}
+
+/* Parses a trace line, returning 1 for a sample, 0 for nothing and -1 for
+ * garbage.
+ */
+static int
+parse(char *line, struct trace_sample *s)
+{
+	char *p;
+	int n;
+
+	if ((p = strchr(line, '#')) != NULL)
+		*p = '\0';
+	for (p = line; *p; p++)
+		if (*p == ',')
+			*p = ' ';
+	for (p = line; *p == ' ' || *p == '\t' || *p == '\n'; p++)
+		;
+	if (*p == '\0')
+		return 0;
+
+	n = sscanf(p, "%lld %lld %lld %lld %lld %llu %lld %lld",
+	    (long long *) &s->host, (long long *) &s->real,
+	    (long long *) &s->mono, (long long *) &s->raw,
+	    (long long *) &s->boot, (unsigned long long *) &s->cycles,
+	    (long long *) &s->offset, (long long *) &s->width);
+
+	return n == 8 ? 1 : -1;
+}
+
+static s64
+nabs(s64 v)
+{
+	return v < 0 ? -v : v;
+}
+
+/* Fits the frequency to a ring of the last n points, oldest first as the
+ * core expects.
+ */
+static int
+fit(const struct vmmci_core_point *ring, unsigned int size, unsigned int n,
+    s64 *ppb)
+{
+	static struct vmmci_core_point pts[MAX_WINDOW];
+	unsigned int i, count = n < size ? n : size;
+
+	for (i = 0; i < count; i++)
+		pts[i] = ring[(n - count + i) % size];
+
+	return vmmci_core_freq(pts, count, ppb);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmmci_core_params p = {
+		.sync_threshold = 1000 * NSEC_PER_MSEC,
+		.autostep_threshold = 5000 * NSEC_PER_MSEC,
+		.autostep_confirm = 3,
+		.autostep_interval = 300 * NSEC_PER_SEC,
+		.slew_max = 0,
+	};
+	static struct vmmci_core_point window[MAX_WINDOW];
+	static struct vmmci_stab stab;
+	const s64 mtie_windows[] = {
+		60 * NSEC_PER_SEC, 300 * NSEC_PER_SEC, 900 * NSEC_PER_SEC,
+		3600 * NSEC_PER_SEC,
+	};
+	struct vmmci_autostep st = { 0 };
+	struct trace_sample s, first;
+	unsigned long long samples = 0, steps = 0, slews = 0, suspects = 0;
+	unsigned int nwindow = 64, npoints = 0, lineno = 0;
+	s64 corr = 0, slew_left = 0, last_raw = 0, offset, max_abs = 0;
+	s64 dt, room, ppb = 0, tau0, adev, tdev;
+	double sum_abs = 0, start;
+	const char *action;
+	char line[512];
+	FILE *f = stdin;
+	int ch, rc, i, have_freq = 0;
+
+	while ((ch = getopt(argc, argv, "a:c:i:s:t:vw:")) != -1) {
+		switch (ch) {
+		case 'a':
+			p.autostep_threshold = number(optarg, 0, 1LL << 32)
+			    * NSEC_PER_MSEC;
+			break;
+		case 'c':
+			p.autostep_confirm = number(optarg, 1, 1000);
+			break;
+		case 'i':
+			p.autostep_interval = number(optarg, 0, 1LL << 32)
+			    * NSEC_PER_SEC;
+			break;
+		case 's':
+			p.slew_max = number(optarg, 0, 1LL << 32) * 1000;
+			break;
+		case 't':
+			p.sync_threshold = number(optarg, 0, 1LL << 32)
+			    * NSEC_PER_MSEC;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			nwindow = number(optarg, 2, MAX_WINDOW);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1 && (f = fopen(argv[0], "r")) == NULL) {
+		fprintf(stderr, "vmmci-replay: %s: %s\n", argv[0],
+		    strerror(errno));
+		return 1;
+	}
+
+	if (verbose)
+		printf("# raw offset action freq_ppb\n");
+
+	vmmci_stab_init(&stab, mtie_windows, 4);
+
+	start = now();
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		rc = parse(line, &s);
+		if (rc == 0)
+			continue;
+		if (rc < 0) {
+			fprintf(stderr, "vmmci-replay: line %u: bad sample\n",
+			    lineno);
+			return 1;
+		}
+
+		// Start off wherever the traced guest was, like a fresh boot
+		if (samples == 0) {
+			first = s;
+			corr = s.host - s.raw - s.offset;
+			if (vmmci_core_needs_sync(&p, s.offset))
+				corr += s.offset;
+		} else {
+			// Let any slew in progress run until now
+			dt = s.raw - last_raw;
+			room = dt / 1000000 * SLEW_MAX_PPM;
+			if (nabs(slew_left) <= room) {
+				corr += slew_left;
+				slew_left = 0;
+			} else {
+				corr += slew_left < 0 ? -room : room;
+				slew_left += slew_left < 0 ? room : -room;
+			}
+		}
+		last_raw = s.raw;
+		samples++;
+
+		offset = s.host - s.raw - corr;
+		sum_abs += nabs(offset);
+		if (nabs(offset) > max_abs)
+			max_abs = nabs(offset);
+
+		window[npoints % nwindow].raw = s.raw;
+		window[npoints % nwindow].phase = s.host - s.raw;
+		npoints++;
+		have_freq = fit(window, nwindow, npoints, &ppb) == 0;
+		vmmci_stab_add(&stab, s.raw, s.host - s.raw, offset);
+
+		switch (vmmci_core_decide(&p, &st, offset, s.boot)) {
+		case VMMCI_CORE_STEP:
+			corr += offset;
+			slew_left = 0;
+			steps++;
+			action = "step";
+			break;
+		case VMMCI_CORE_SLEW:
+			slew_left = offset;
+			slews++;
+			action = "slew";
+			break;
+		case VMMCI_CORE_SUSPECT:
+			suspects++;
+			action = "suspect";
+			break;
+		default:
+			action = "-";
+			break;
+		}
+
+		if (verbose)
+			printf("%lld %lld %s %lld\n", (long long) s.raw,
+			    (long long) offset, action,
+			    have_freq ? (long long) ppb : 0LL);
+	}
+	if (f != stdin)
+		fclose(f);
+
+	if (samples == 0) {
+		fprintf(stderr, "vmmci-replay: no samples\n");
+		return 1;
+	}
+
+	printf("samples %llu\n", samples);
+	printf("span_s %.3f\n", (s.raw - first.raw) / 1e9);
+	printf("steps %llu\n", steps);
+	printf("slews %llu\n", slews);
+	printf("suspects %llu\n", suspects);
+	printf("mean_abs_offset_ns %.0f\n", sum_abs / samples);
+	printf("max_abs_offset_ns %lld\n", (long long) max_abs);
+	if (have_freq)
+		printf("freq_ppb %lld\n", (long long) ppb);
+
+	tau0 = vmmci_stab_tau0(&stab);
+	for (i = 0; i < VMMCI_STAB_OCTAVES; i++) {
+		if (vmmci_stab_dev(&stab, i, &adev, &tdev))
+			break;
+		printf("tau_ms %lld adev_ppt %lld tdev_ns %lld\n",
+		    (long long) ((tau0 << i) / NSEC_PER_MSEC), (long long) adev,
+		    (long long) tdev);
+	}
+	for (i = 0; i < VMMCI_STAB_WINDOWS && stab.window[i]; i++)
+		printf("window_s %lld mtie_ns %lld\n",
+		    (long long) (stab.window[i] / NSEC_PER_SEC),
+		    (long long) stab.mtie[i]);
+
+	printf("replay_s %.6f\n", now() - start);
+
+	return 0;
+}
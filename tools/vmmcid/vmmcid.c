@@ -0,0 +1,426 @@
+/*
+ *  vmmcid - userspace companion for the Linux vmmci driver
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Reads the record stream from /dev/vmmci and:
+ *
+ *  - feeds each drift sample to chronyd as a SOCK refclock, so chrony can
+ *    weigh vmmci against whatever other sources it has
+ *  - keeps a metrics file up to date in the Prometheus text exposition
+ *    format, e.g. for node_exporter's textfile collector
+ *  - appends each sample to a trace file that vmmci-replay can read
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "virtio_vmmci_uapi.h"
+
+/* From chrony's refclock_sock.c */
+#define SOCK_MAGIC 0x534f434b
+
+struct sock_sample {
+	struct timeval tv;	/* time of the measurement (system time) */
+	double offset;		/* true time less system time, in seconds */
+	int pulse;
+	int leap;
+	int _pad;
+	int magic;
+};
+
+/* Matches the driver's enum vmmci_cmd */
+static const char *commands[] = {
+	"none", "shutdown", "reboot", "syncrtc",
+};
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static struct {
+	unsigned long long samples;
+	double drift;
+	double width;
+	unsigned long long commands[NCOMMANDS + 1];	/* last is unknown */
+	unsigned long long commands_polled;
+	unsigned long long syncs_ok;
+	unsigned long long syncs_failed;
+	double sync_duration;
+	double sync_step;
+	unsigned long long dropped;
+	unsigned long long refclock_sent;
+	unsigned long long refclock_failed;
+	unsigned long long refclock_skipped;
+} metrics;
+
+static int foreground = 0;
+static int verbose = 0;
+static volatile sig_atomic_t done = 0;
+
+static void
+logmsg(int prio, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (prio == LOG_DEBUG && !verbose)
+		return;
+
+	va_start(ap, fmt);
+	if (foreground) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	} else
+		vsyslog(prio, fmt, ap);
+	va_end(ap);
+}
+
+static void
+handle_signal(int sig)
+{
+	(void) sig;
+	done = 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: vmmcid [-fv] [-d device] [-m metrics file] "
+	    "[-s chrony socket] [-t trace file]\n");
+	exit(1);
+}
+
+/* daemon() moves us to /, so relative paths have to be made absolute first */
+static const char *
+abspath(const char *path)
+{
+	char cwd[4096], *abs;
+	size_t len;
+
+	if (path == NULL || path[0] == '/')
+		return path;
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		fprintf(stderr, "vmmcid: getcwd: %s\n", strerror(errno));
+		exit(1);
+	}
+	len = strlen(cwd) + strlen(path) + 2;
+	if ((abs = malloc(len)) == NULL) {
+		fprintf(stderr, "vmmcid: %s\n", strerror(errno));
+		exit(1);
+	}
+	snprintf(abs, len, "%s/%s", cwd, path);
+	return abs;
+}
+
+/* Opens a datagram socket for talking to chronyd's SOCK refclock */
+static int
+refclock_open(const char *path, struct sockaddr_un *addr)
+{
+	int fd;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		logmsg(LOG_ERR, "chrony socket path too long: %s", path);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0)
+		logmsg(LOG_ERR, "socket: %s", strerror(errno));
+
+	return fd;
+}
+
+/* Hands a sample to chronyd. It's fine if chrony isn't listening (yet).
+ * Samples the driver's source consensus outvoted aren't sent at all, so
+ * chrony doesn't end up trusting a reading the driver itself threw out.
+ */
+static void
+refclock_send(int fd, struct sockaddr_un *addr, struct vmmci_record *rec)
+{
+	struct sock_sample sample;
+
+	if (rec->flags & VMMCI_RECORD_F_OUTVOTED) {
+		metrics.refclock_skipped++;
+		return;
+	}
+
+	memset(&sample, 0, sizeof(sample));
+	sample.tv.tv_sec = rec->real_ns / 1000000000LL;
+	sample.tv.tv_usec = (rec->real_ns % 1000000000LL) / 1000;
+	sample.offset = rec->offset_ns / 1e9;
+	sample.magic = SOCK_MAGIC;
+
+	if (sendto(fd, &sample, sizeof(sample), 0, (struct sockaddr *) addr,
+	    sizeof(*addr)) != sizeof(sample)) {
+		if (metrics.refclock_failed++ == 0)
+			logmsg(LOG_WARNING, "failed to send sample to chrony: %s",
+			    strerror(errno));
+		return;
+	}
+	metrics.refclock_sent++;
+}
+
+static void
+metric(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Rewrites the metrics file in place via a rename so scrapers never see a
+ * partial file.
+ */
+static void
+metrics_write(const char *path)
+{
+	char tmp[4096];
+	FILE *f;
+	size_t i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		logmsg(LOG_ERR, "%s: %s", tmp, strerror(errno));
+		return;
+	}
+
+	metric(f, "vmmci_samples_total", "counter",
+	    "Drift samples accepted by the driver.");
+	fprintf(f, "vmmci_samples_total %llu\n", metrics.samples);
+	metric(f, "vmmci_drift_seconds", "gauge",
+	    "Host clock less guest CLOCK_REALTIME in the last sample.");
+	fprintf(f, "vmmci_drift_seconds %.9f\n", metrics.drift);
+	metric(f, "vmmci_bracket_width_seconds", "gauge",
+	    "Width of the guest clock bracket around the last host read.");
+	fprintf(f, "vmmci_bracket_width_seconds %.9f\n", metrics.width);
+
+	metric(f, "vmmci_commands_total", "counter",
+	    "Commands received from the host.");
+	for (i = 1; i < NCOMMANDS; i++)
+		fprintf(f, "vmmci_commands_total{command=\"%s\"} %llu\n",
+		    commands[i], metrics.commands[i]);
+	fprintf(f, "vmmci_commands_total{command=\"unknown\"} %llu\n",
+	    metrics.commands[NCOMMANDS]);
+	metric(f, "vmmci_commands_polled_total", "counter",
+	    "Commands the driver only found by polling (lost interrupts).");
+	fprintf(f, "vmmci_commands_polled_total %llu\n",
+	    metrics.commands_polled);
+
+	metric(f, "vmmci_syncs_total", "counter", "Clock syncs by result.");
+	fprintf(f, "vmmci_syncs_total{result=\"ok\"} %llu\n", metrics.syncs_ok);
+	fprintf(f, "vmmci_syncs_total{result=\"failed\"} %llu\n",
+	    metrics.syncs_failed);
+	metric(f, "vmmci_sync_duration_seconds", "gauge",
+	    "How long the last clock sync took.");
+	fprintf(f, "vmmci_sync_duration_seconds %.9f\n", metrics.sync_duration);
+	metric(f, "vmmci_sync_step_seconds", "gauge",
+	    "How far the last clock sync stepped CLOCK_REALTIME.");
+	fprintf(f, "vmmci_sync_step_seconds %.9f\n", metrics.sync_step);
+
+	metric(f, "vmmci_records_dropped_total", "counter",
+	    "Records missed because we fell behind the driver.");
+	fprintf(f, "vmmci_records_dropped_total %llu\n", metrics.dropped);
+	metric(f, "vmmci_refclock_samples_total", "counter",
+	    "Samples handed to chronyd by result.");
+	fprintf(f, "vmmci_refclock_samples_total{result=\"ok\"} %llu\n",
+	    metrics.refclock_sent);
+	fprintf(f, "vmmci_refclock_samples_total{result=\"failed\"} %llu\n",
+	    metrics.refclock_failed);
+	fprintf(f, "vmmci_refclock_samples_total{result=\"outvoted\"} %llu\n",
+	    metrics.refclock_skipped);
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		logmsg(LOG_ERR, "%s: %s", path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/* Writes a sample in the same format as the driver's debugfs samples file */
+static void
+trace_write(FILE *f, struct vmmci_record *rec)
+{
+	fprintf(f, "%lld %lld %lld %lld %lld %llu %lld %lld\n",
+	    (long long) rec->host_ns, (long long) rec->real_ns,
+	    (long long) rec->mono_ns, (long long) rec->raw_ns,
+	    (long long) rec->boot_ns, (unsigned long long) rec->cycles,
+	    (long long) rec->offset_ns, (long long) rec->width_ns);
+	fflush(f);
+}
+
+static void
+handle_record(struct vmmci_record *rec)
+{
+	switch (rec->type) {
+	case VMMCI_RECORD_SAMPLE:
+		metrics.samples++;
+		metrics.drift = rec->offset_ns / 1e9;
+		metrics.width = rec->width_ns / 1e9;
+		logmsg(LOG_DEBUG, "sample: offset %lld ns, width %lld ns",
+		    (long long) rec->offset_ns, (long long) rec->width_ns);
+		break;
+
+	case VMMCI_RECORD_COMMAND:
+		metrics.commands[rec->cmd < NCOMMANDS ? rec->cmd : NCOMMANDS]++;
+		if (rec->flags & VMMCI_RECORD_F_POLLED)
+			metrics.commands_polled++;
+		logmsg(LOG_INFO, "host command: %s%s", rec->cmd < NCOMMANDS
+		    ? commands[rec->cmd] : "unknown",
+		    rec->flags & VMMCI_RECORD_F_POLLED ? " (polled)" : "");
+		break;
+
+	case VMMCI_RECORD_SYNC:
+		if (rec->result == 0)
+			metrics.syncs_ok++;
+		else
+			metrics.syncs_failed++;
+		metrics.sync_duration = rec->duration_ns / 1e9;
+		metrics.sync_step = rec->offset_ns / 1e9;
+		logmsg(LOG_INFO, "clock sync: result %d, step %lld ns, took %lld ns",
+		    rec->result, (long long) rec->offset_ns,
+		    (long long) rec->duration_ns);
+		break;
+
+	default:
+		logmsg(LOG_DEBUG, "ignoring record type %u", rec->type);
+		break;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *device = "/dev/" VMMCI_DEVICE_NAME;
+	const char *metrics_path = NULL, *sock_path = NULL, *trace_path = NULL;
+	FILE *trace = NULL;
+	struct vmmci_record recs[32];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int ch, fd, sock = -1;
+	unsigned long long next_seq = 0;
+	ssize_t n, i;
+
+	while ((ch = getopt(argc, argv, "d:fm:s:t:v")) != -1) {
+		switch (ch) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 's':
+			sock_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	metrics_path = abspath(metrics_path);
+	sock_path = abspath(sock_path);
+	trace_path = abspath(trace_path);
+
+	openlog("vmmcid", LOG_PID, LOG_DAEMON);
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "vmmcid: %s: %s\n", device, strerror(errno));
+		return 1;
+	}
+
+	if (sock_path != NULL) {
+		sock = refclock_open(sock_path, &addr);
+		if (sock < 0)
+			return 1;
+	}
+
+	if (trace_path != NULL) {
+		trace = fopen(trace_path, "a");
+		if (trace == NULL) {
+			fprintf(stderr, "vmmcid: %s: %s\n", trace_path,
+			    strerror(errno));
+			return 1;
+		}
+	}
+
+	if (!foreground && daemon(0, 0) != 0) {
+		fprintf(stderr, "vmmcid: daemon: %s\n", strerror(errno));
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (metrics_path != NULL)
+		metrics_write(metrics_path);
+
+	while (!done) {
+		n = read(fd, recs, sizeof(recs));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			logmsg(LOG_ERR, "%s: %s", device, strerror(errno));
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n / (ssize_t) sizeof(recs[0]); i++) {
+			if (recs[i].seq > next_seq && next_seq != 0)
+				metrics.dropped += recs[i].seq - next_seq;
+			next_seq = recs[i].seq + 1;
+
+			handle_record(&recs[i]);
+			if (sock >= 0 && recs[i].type == VMMCI_RECORD_SAMPLE)
+				refclock_send(sock, &addr, &recs[i]);
+			if (trace != NULL && recs[i].type == VMMCI_RECORD_SAMPLE)
+				trace_write(trace, &recs[i]);
+		}
+
+		if (metrics_path != NULL)
+			metrics_write(metrics_path);
+	}
+
+	if (trace != NULL)
+		fclose(trace);
+	if (sock >= 0)
+		close(sock);
+	close(fd);
+
+	return 0;
+}
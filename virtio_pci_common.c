@@ -269,16 +269,35 @@ static int virtio_pci_sriov_configure(struct pci_dev *pci_dev, int num_vfs)
 }
 
 #ifdef CONFIG_PM_SLEEP
+/* vmm(4) doesn't do power management itself, but guests can still be
+ * suspended or hibernated from the inside, so hand off to the virtio core
+ * which will in turn quiesce the vmmci driver.
+ */
 static int virtio_pci_freeze(struct device *dev)
 {
-	// XXX: vmm(4) does not support power management
-	return 0;
+	struct pci_dev *pci_dev = to_pci_dev(dev);
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(pci_dev);
+	int rc;
+
+	rc = virtio_device_freeze(&vp_dev->vdev);
+	if (!rc)
+		pci_disable_device(pci_dev);
+
+	return rc;
 }
 
 static int virtio_pci_restore(struct device *dev)
 {
-	// XXX: vmm(4) does not support power management
-	return 0;
+	struct pci_dev *pci_dev = to_pci_dev(dev);
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(pci_dev);
+	int rc;
+
+	rc = pci_enable_device(pci_dev);
+	if (rc)
+		return rc;
+
+	pci_set_master(pci_dev);
+	return virtio_device_restore(&vp_dev->vdev);
 }
 
 static const struct dev_pm_ops virtio_pci_pm_ops = {
@@ -292,6 +311,9 @@ static struct pci_driver virtio_pci_driver = {
 	.id_table	= virtio_pci_id_table,
 	.probe		= virtio_pci_probe,
 	.remove		= virtio_pci_remove,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 #ifdef CONFIG_PM_SLEEP
 	.driver.pm	= &virtio_pci_pm_ops,
 #endif
@@ -32,7 +32,24 @@
 #define VMMCI_RTC_DEVICE	CONFIG_RTC_SYSTOHC_DEVICE
 #endif
 
-const char *QNAME_MONITOR = "vmmci-monitor";
+/* The kernel only lets us inject sleep time (to correct CLOCK_BOOTTIME after
+ * the host suspends) when built in and configured for rtc based suspend
+ * accounting. The symbol isn't exported to modules.
+ */
+#if defined(CONFIG_PM_SLEEP) && defined(CONFIG_RTC_HCTOSYS_DEVICE) \
+    && !defined(MODULE)
+#define VMMCI_HAVE_SLEEPTIME
+#endif
+
+/* Sync policies can be swapped at runtime with BPF struct_ops, which modules
+ * can only offer from 6.9 on (and with bpf_link aware callbacks from 6.11).
+ */
+#if defined(CONFIG_BPF_SYSCALL) && defined(CONFIG_BPF_JIT) \
+    && LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+#define VMMCI_HAVE_BPF_POLICY
+#endif
+
+#define QNAME_MONITOR		"vmmci-monitor"
 
 /* This should be picked up from the kernel config */
 #ifdef CONFIG_HZ
@@ -46,6 +63,56 @@ const char *QNAME_MONITOR = "vmmci-monitor";
 #define DELAY_1s HZ
 #define DELAY_20s 20 * HZ
 
+/* Number of back-to-back host clock reads per drift sample. We keep the one
+ * with the tightest guest clock bracket.
+ */
+#define VMMCI_SAMPLE_READS		4
+
+/* Reads whose offset is further than this (in ns) from the median of a
+ * sample's reads are considered bogus and discarded.
+ */
+#define VMMCI_SAMPLE_TOLERANCE		NSEC_PER_MSEC
+
+/* Number of drift sampling intervals without a fresh sample after which
+ * the clock is flagged as unsynchronized.
+ */
+#define VMMCI_STALE_SAMPLES		3
+
+/* Number of accepted samples we keep around (a power of 2) */
+#define VMMCI_HISTORY			64
+
+/* Number of records buffered for readers of /dev/vmmci (a power of 2) */
+#define VMMCI_RECORDS			256
+
+/* How often to poll the command register in case the config change
+ * interrupt got lost, in ms: until an interrupt has delivered a command,
+ * once one has and once polling has caught one the interrupt missed. The
+ * first has to beat vmd(8)'s 3s ack timeout before it kills us.
+ */
+#define VMMCI_POLL_MS			1000
+#define VMMCI_POLL_SLOW_MS		30000
+#define VMMCI_POLL_FAST_MS		250
+
+/* Polls after which, with no command seen at all, we stop paying for the
+ * faster rate and poll as if interrupts worked (10 minutes' worth)
+ */
+#define VMMCI_POLL_IDLE			600
+
+/* How long a command found by polling gets for its interrupt to show up */
+#define VMMCI_POLL_GRACE_MS		100
+
+/* Most iterations a single debugfs benchmark run may ask for. Each sync
+ * really steps the clock, reads the rtc and tells subscribers, so those
+ * get far fewer.
+ */
+#define VMMCI_BENCH_MAX			100000
+#define VMMCI_BENCH_SYNC_MAX		10
+
+/* How far (in ns) the host clock may stray from where a saved estimator
+ * state predicts before we decide it's not the same host clock anymore.
+ */
+#define VMMCI_STATE_TOLERANCE		(10 * NSEC_PER_MSEC)
+
 #define VIRTIO_ID_VMMCI			0xffff	/* matches OpenBSD's private id */
 
 #define PCI_VENDOR_ID_OPENBSD		0x0b5d
@@ -56,6 +123,14 @@ const char *QNAME_MONITOR = "vmmci-monitor";
 #define VMMCI_CONFIG_TIME_SEC		4
 #define VMMCI_CONFIG_TIME_USEC		12
 
+/* Commands vmd(8) leaves in VMMCI_CONFIG_COMMAND */
+enum vmmci_cmd {
+	VMMCI_NONE = 0,
+	VMMCI_SHUTDOWN,
+	VMMCI_REBOOT,
+	VMMCI_SYNCRTC,
+};
+
 /* Features...these get bit-shifted in the Linux virtio code */
 #define VMMCI_F_TIMESYNC		0
 #define VMMCI_F_ACK			1
@@ -0,0 +1,407 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Keep this file free of kernel APIs beyond the couple of shims below so it
+ * keeps building in userspace. See virtio_vmmci_core.h.
+ */
+#include "virtio_vmmci_core.h"
+
+#ifdef __KERNEL__
+#include <linux/math64.h>
+
+#define core_div(a, b)	div64_s64((a), (b))
+#else
+#define core_div(a, b)	((a) / (b))
+#endif
+
+static s64 core_abs(s64 v)
+{
+	return v < 0 ? -v : v;
+}
+
+/* Returns the median of a handful of values (the upper one for an even
+ * count, so it's always one of the values).
+ */
+s64 vmmci_core_median(const s64 *v, int n)
+{
+	s64 sorted[VMMCI_CORE_MAX_READS], tmp;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		tmp = v[i];
+		for (j = i; j > 0 && sorted[j - 1] > tmp; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = tmp;
+	}
+
+	return sorted[n / 2];
+}
+
+/* Picks the read with the narrowest bracket since it's the least likely to
+ * have been disturbed by a vm exit taking longer than usual. Reads more than
+ * tolerance away from the median (e.g. a torn read or one that straddled a
+ * second rollover) are thrown out first, no matter how narrow. Returns the
+ * index of the chosen read.
+ */
+int vmmci_core_pick(const s64 *offsets, const s64 *widths, int n,
+    s64 tolerance)
+{
+	s64 median = vmmci_core_median(offsets, n);
+	int i, best = -1;
+
+	for (i = 0; i < n; i++) {
+		if (core_abs(offsets[i] - median) > tolerance)
+			continue;
+		if (best < 0 || widths[i] < widths[best])
+			best = i;
+	}
+
+	return best;
+}
+
+/* Returns true if an offset is beyond what our policy tolerates */
+bool vmmci_core_needs_sync(const struct vmmci_core_params *p, s64 offset)
+{
+	return core_abs(offset) > p->sync_threshold;
+}
+
+/* Decides whether a sample confirms a large jump worth stepping for. The
+ * caller is expected to resample quickly while we're suspicious. Samples
+ * between half the threshold and the threshold are let go without a
+ * verdict, but don't clear what the ones before them confirmed.
+ */
+enum vmmci_autostep_verdict vmmci_core_autostep(
+    const struct vmmci_core_params *p, struct vmmci_autostep *st,
+    s64 offset, s64 boot)
+{
+	s64 drift = core_abs(offset);
+
+	if (drift <= p->autostep_threshold >> 1) {
+		st->confirmed = 0;
+		return VMMCI_AUTOSTEP_IDLE;
+	}
+
+	if (drift <= p->autostep_threshold)
+		return VMMCI_AUTOSTEP_IDLE;
+
+	st->confirmed++;
+	if (st->confirmed < p->autostep_confirm)
+		return VMMCI_AUTOSTEP_SUSPECT;
+
+	if (st->stepped && boot - st->last_step < p->autostep_interval)
+		return VMMCI_AUTOSTEP_IDLE;
+
+	st->confirmed = 0;
+	st->last_step = boot;
+	st->stepped = true;
+	return VMMCI_AUTOSTEP_STEP;
+}
+
+/* The drift monitor's policy: step for big confirmed jumps and slew away
+ * anything small enough.
+ */
+enum vmmci_core_action vmmci_core_decide(const struct vmmci_core_params *p,
+    struct vmmci_autostep *st, s64 offset, s64 boot)
+{
+	if (p->autostep_threshold) {
+		switch (vmmci_core_autostep(p, st, offset, boot)) {
+		case VMMCI_AUTOSTEP_STEP:
+			return VMMCI_CORE_STEP;
+		case VMMCI_AUTOSTEP_SUSPECT:
+			return VMMCI_CORE_SUSPECT;
+		default:
+			break;
+		}
+	}
+
+	if (p->slew_max && offset != 0 && core_abs(offset) <= p->slew_max)
+		return VMMCI_CORE_SLEW;
+
+	return VMMCI_CORE_NONE;
+}
+
+/* Estimates how fast the host clock runs relative to our raw clock, in
+ * parts per billion, by a least squares fit of phase against time. Points
+ * must be oldest first, and only those since the last phase step are fit
+ * since the rate before a host step or suspend says nothing about now.
+ * Returns 0 on success or -1 if there's too little to fit.
+ */
+int vmmci_core_freq(const struct vmmci_core_point *pts, unsigned int n,
+    s64 *ppb)
+{
+	s64 t_mean = 0, x_mean = 0, t_max = 0, x_max = 0, t, x, num = 0,
+	    den = 0, slope;
+	unsigned int i, first = 0, t_shift = 0, x_shift = 0;
+
+	for (i = 1; i < n; i++) {
+		if (core_abs(pts[i].phase - pts[i - 1].phase)
+		    > VMMCI_CORE_PHASE_STEP + core_div(pts[i].raw
+		    - pts[i - 1].raw, VMMCI_CORE_MAX_SLEW))
+			first = i;
+	}
+	pts += first;
+	n -= first;
+	if (n < 2 || n > VMMCI_CORE_MAX_POINTS)
+		return -1;
+
+	// Averaging differences from the first point keeps these in range
+	for (i = 1; i < n; i++) {
+		t_mean += pts[i].raw - pts[0].raw;
+		x_mean += pts[i].phase - pts[0].phase;
+	}
+	t_mean = core_div(t_mean, (s64) n);
+	x_mean = core_div(x_mean, (s64) n);
+
+	// Times are taken in ms and phases in ns, both then scaled down by
+	// powers of 2 until |t| <= 2^16 and |x| <= 2^20, so that even with
+	// VMMCI_CORE_MAX_POINTS the sums (and the slope with 16 more bits
+	// below) fit in 64 bits.
+	for (i = 0; i < n; i++) {
+		t = core_abs(pts[i].raw - pts[0].raw - t_mean);
+		x = core_abs(pts[i].phase - pts[0].phase - x_mean);
+		t_max = t > t_max ? t : t_max;
+		x_max = x > x_max ? x : x_max;
+	}
+	t_max = core_div(t_max, 1000000);
+	while ((t_max >> t_shift) > (1 << 16))
+		t_shift++;
+	while ((x_max >> x_shift) > (1 << 20))
+		x_shift++;
+
+	for (i = 0; i < n; i++) {
+		t = core_div(core_div(pts[i].raw - pts[0].raw - t_mean,
+		    1000000), (s64) 1 << t_shift);
+		x = core_div(pts[i].phase - pts[0].phase - x_mean,
+		    (s64) 1 << x_shift);
+		num += t * x;
+		den += t * t;
+	}
+	if (den == 0)
+		return -1;
+
+	// The slope is in units of 2^x_shift ns per 2^t_shift ms, kept with
+	// 16 more bits. Unscaled, ns per ms is parts per million.
+	slope = core_div(num * 65536, den) * 1000;
+	if (16 + t_shift >= x_shift)
+		*ppb = core_div(slope, (s64) 1 << (16 + t_shift - x_shift));
+	else
+		*ppb = slope * ((s64) 1 << (x_shift - 16 - t_shift));
+
+	return 0;
+}
+
+/* Marzullo's algorithm: finds the range [lo, hi] covered by the most of
+ * the intervals [offset - error, offset + error], one per time source, and
+ * flags each source whose interval reaches it. Intervals that only touch
+ * still count as agreeing. Returns how many sources agree, which is up to
+ * the caller to compare against a quorum.
+ */
+int vmmci_core_intersect(const s64 *offsets, const s64 *errors, int n,
+    bool *agree, s64 *lo, s64 *hi)
+{
+	struct {
+		s64 at;
+		int edge;	/* +1 opens an interval, -1 closes one */
+	} ends[2 * VMMCI_CORE_MAX_SOURCES], tmp;
+	int i, j, m = 0, count = 0, best = 0;
+
+	for (i = 0; i < n; i++) {
+		ends[m].at = offsets[i] - errors[i];
+		ends[m++].edge = 1;
+		ends[m].at = offsets[i] + errors[i];
+		ends[m++].edge = -1;
+	}
+
+	// Sort by offset, opening before closing on ties
+	for (i = 1; i < m; i++) {
+		tmp = ends[i];
+		for (j = i; j > 0 && (ends[j - 1].at > tmp.at
+		    || (ends[j - 1].at == tmp.at && ends[j - 1].edge < tmp.edge));
+		    j--)
+			ends[j] = ends[j - 1];
+		ends[j] = tmp;
+	}
+
+	// The next edge after a new best opening is where that range ends
+	for (i = 0; i < m; i++) {
+		count += ends[i].edge;
+		if (count > best) {
+			best = count;
+			*lo = ends[i].at;
+			*hi = ends[i + 1].at;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		agree[i] = best && offsets[i] - errors[i] <= *hi
+		    && offsets[i] + errors[i] >= *lo;
+
+	return best;
+}
+
+/* Integer square root, rounded down */
+static u64 core_sqrt(u64 v)
+{
+	u64 root = 0, bit = 1ULL << 62;
+
+	while (bit > v)
+		bit >>= 2;
+	while (bit) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		} else
+			root >>= 1;
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+/* Folds a value into a running mean over the last VMMCI_STAB_AVERAGE or so
+ * values. Second differences are clamped to 3s first, so squares (and
+ * their differences) fit in 64 bits even across a wild host step.
+ */
+static void stab_mean(s64 *mean, u64 *n, s64 v)
+{
+	s64 sq;
+
+	if (v > 3000000000LL)
+		v = 3000000000LL;
+	else if (v < -3000000000LL)
+		v = -3000000000LL;
+	sq = v * v;
+
+	if (*n < VMMCI_STAB_AVERAGE)
+		(*n)++;
+	*mean += core_div(sq - *mean, (s64) *n);
+}
+
+static const struct vmmci_stab_point *stab_at(const struct vmmci_stab *s,
+    u64 ago)
+{
+	return &s->ring[(s->n - 1 - ago) % VMMCI_STAB_POINTS];
+}
+
+/* Sum of the phase of m points, starting ago points back */
+static s64 stab_sum(const struct vmmci_stab *s, u64 ago, unsigned int m)
+{
+	s64 sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < m; i++)
+		sum += stab_at(s, ago + i)->phase;
+	return sum;
+}
+
+/* Resets the analysis, with MTIE windows of the given lengths */
+void vmmci_stab_init(struct vmmci_stab *s, const s64 *windows, int n)
+{
+	int i;
+
+	*s = (struct vmmci_stab) { 0 };
+	for (i = 0; i < n && i < VMMCI_STAB_WINDOWS; i++)
+		s->window[i] = windows[i];
+}
+
+/* Adds a sample, updating every statistic it completes */
+void vmmci_stab_add(struct vmmci_stab *s, s64 raw, s64 phase, s64 offset)
+{
+	struct vmmci_stab_point *pt;
+	const struct vmmci_stab_point *old;
+	s64 hi, lo;
+	unsigned int m;
+	u64 i;
+	int k;
+
+	// Phase relative to the first sample keeps the sums below in range
+	if (s->n == 0)
+		s->phase0 = phase;
+
+	pt = &s->ring[s->n % VMMCI_STAB_POINTS];
+	pt->raw = raw;
+	pt->phase = phase - s->phase0;
+	pt->offset = offset;
+	s->n++;
+
+	for (k = 0, m = 1; k < VMMCI_STAB_OCTAVES; k++, m <<= 1) {
+		// Overlapping Allan: x[i + 2m] - 2x[i + m] + x[i]
+		if (s->n > 2 * m)
+			stab_mean(&s->adev_sq[k], &s->adev_n[k],
+			    pt->phase - 2 * stab_at(s, m)->phase
+			    + stab_at(s, 2 * m)->phase);
+
+		// Time deviation: the same over m point averages
+		if (s->n >= 3 * m)
+			stab_mean(&s->tdev_sq[k], &s->tdev_n[k], core_div(
+			    stab_sum(s, 0, m) - 2 * stab_sum(s, m, m)
+			    + stab_sum(s, 2 * m, m), (s64) m));
+	}
+
+	// MTIE: worst peak to peak offset in any window ending here
+	for (k = 0; k < VMMCI_STAB_WINDOWS && s->window[k]; k++) {
+		hi = lo = offset;
+		for (i = 1; i < s->n && i < VMMCI_STAB_POINTS; i++) {
+			old = stab_at(s, i);
+			if (raw - old->raw > s->window[k])
+				break;
+			if (old->offset > hi)
+				hi = old->offset;
+			if (old->offset < lo)
+				lo = old->offset;
+		}
+		if (hi - lo > s->mtie[k])
+			s->mtie[k] = hi - lo;
+	}
+}
+
+/* Returns the mean sample interval over the points we still have */
+s64 vmmci_stab_tau0(const struct vmmci_stab *s)
+{
+	u64 n = s->n < VMMCI_STAB_POINTS ? s->n : VMMCI_STAB_POINTS;
+
+	if (n < 2)
+		return 0;
+	return core_div(stab_at(s, 0)->raw - stab_at(s, n - 1)->raw,
+	    (s64) (n - 1));
+}
+
+/* Reports ADEV (in parts per trillion) and TDEV (in ns) at 2^octave times
+ * the sample interval. Returns -1 if there's not enough data yet.
+ */
+int vmmci_stab_dev(const struct vmmci_stab *s, int octave, s64 *adev_ppt,
+    s64 *tdev)
+{
+	s64 tau_us = core_div(vmmci_stab_tau0(s) << octave, 1000);
+
+	if (octave >= VMMCI_STAB_OCTAVES || s->adev_n[octave] == 0
+	    || tau_us <= 0)
+		return -1;
+
+	// ADEV^2 = <(2nd difference)^2> / (2 tau^2), so with the rms over
+	// root 2 in ns and tau in us, ns/us is parts per thousand
+	*adev_ppt = core_div((s64) core_sqrt(s->adev_sq[octave] >> 1)
+	    * 1000000000, tau_us);
+	*tdev = s->tdev_n[octave]
+	    ? (s64) core_sqrt(core_div(s->tdev_sq[octave], 6)) : -1;
+
+	return 0;
+}
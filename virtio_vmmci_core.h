@@ -0,0 +1,147 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef _VIRTIO_VMMCI_CORE_H
+#define _VIRTIO_VMMCI_CORE_H
+
+/* The time keeping smarts of the driver: filtering host clock reads,
+ * estimating our frequency error, voting between time sources and deciding
+ * when to step or slew. None of it touches hardware or kernel state, so the
+ * same code is built into the module and into libvmmcicore for tools like
+ * vmmci-replay.
+ *
+ * All times are in nanoseconds.
+ */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int64_t s64;
+typedef uint64_t u64;
+#endif
+
+/* Most reads vmmci_core_pick() will choose from */
+#define VMMCI_CORE_MAX_READS		16
+
+/* Most points vmmci_core_freq() will fit, oldest first */
+#define VMMCI_CORE_MAX_POINTS		1024
+
+/* Consecutive points whose phase moves by more than this, on top of the
+ * most the kernel would slew (500 ppm) in between, are taken as a step of
+ * the host clock or a host suspend rather than drift.
+ */
+#define VMMCI_CORE_PHASE_STEP		5000000
+#define VMMCI_CORE_MAX_SLEW		2000	/* 1 / 500 ppm */
+
+/* Most time sources vmmci_core_intersect() will vote between */
+#define VMMCI_CORE_MAX_SOURCES		8
+
+/* Knobs for the sync policy. A zero threshold turns that behavior off. */
+struct vmmci_core_params {
+	s64 sync_threshold;	/* step on probe/resume beyond this */
+	s64 autostep_threshold;	/* step from the drift monitor beyond this */
+	unsigned int autostep_confirm;	/* ...after this many samples */
+	s64 autostep_interval;	/* ...but no more often than this */
+	s64 slew_max;		/* slew instead when within this */
+};
+
+/* Where the drift monitor stands on automatically stepping the clock */
+enum vmmci_autostep_verdict {
+	VMMCI_AUTOSTEP_IDLE = 0,
+	VMMCI_AUTOSTEP_SUSPECT,
+	VMMCI_AUTOSTEP_STEP,
+};
+
+struct vmmci_autostep {
+	unsigned int confirmed;	/* consecutive samples over threshold */
+	s64 last_step;		/* CLOCK_BOOTTIME of our last step */
+	bool stepped;
+};
+
+/* What the drift monitor should do about a sample */
+enum vmmci_core_action {
+	VMMCI_CORE_NONE = 0,
+	VMMCI_CORE_SUSPECT,	/* resample soon to confirm a jump */
+	VMMCI_CORE_SLEW,
+	VMMCI_CORE_STEP,
+};
+
+/* A point in our phase history: host time less the guest's raw clock, at
+ * a given raw clock time.
+ */
+struct vmmci_core_point {
+	s64 raw;
+	s64 phase;
+};
+
+/* Stability analysis over a long run of samples. ADEV and TDEV are taken
+ * at octave spaced tau (1, 2, 4... times the sample interval) from the free
+ * running phase (host less raw), so they describe the oscillator and host
+ * noise. MTIE is taken over fixed windows from the offset of the clock we
+ * actually keep, so it includes host induced steps and our own corrections.
+ */
+#define VMMCI_STAB_POINTS		256	/* a power of 2 */
+#define VMMCI_STAB_OCTAVES		6	/* so up to 32 tau0 */
+#define VMMCI_STAB_WINDOWS		4
+#define VMMCI_STAB_AVERAGE		1024	/* then decays exponentially */
+
+struct vmmci_stab_point {
+	s64 raw;
+	s64 phase;
+	s64 offset;
+};
+
+struct vmmci_stab {
+	struct vmmci_stab_point ring[VMMCI_STAB_POINTS];
+	u64 n;
+	s64 phase0;
+
+	/* Running means of squared second differences (ns^2) */
+	s64 adev_sq[VMMCI_STAB_OCTAVES];
+	s64 tdev_sq[VMMCI_STAB_OCTAVES];
+	u64 adev_n[VMMCI_STAB_OCTAVES];
+	u64 tdev_n[VMMCI_STAB_OCTAVES];
+
+	s64 window[VMMCI_STAB_WINDOWS];	/* 0 if unused */
+	s64 mtie[VMMCI_STAB_WINDOWS];
+};
+
+s64 vmmci_core_median(const s64 *v, int n);
+int vmmci_core_pick(const s64 *offsets, const s64 *widths, int n,
+    s64 tolerance);
+bool vmmci_core_needs_sync(const struct vmmci_core_params *p, s64 offset);
+enum vmmci_autostep_verdict vmmci_core_autostep(
+    const struct vmmci_core_params *p, struct vmmci_autostep *st,
+    s64 offset, s64 boot);
+enum vmmci_core_action vmmci_core_decide(const struct vmmci_core_params *p,
+    struct vmmci_autostep *st, s64 offset, s64 boot);
+int vmmci_core_freq(const struct vmmci_core_point *pts, unsigned int n,
+    s64 *ppb);
+int vmmci_core_intersect(const s64 *offsets, const s64 *errors, int n,
+    bool *agree, s64 *lo, s64 *hi);
+void vmmci_stab_init(struct vmmci_stab *s, const s64 *windows, int n);
+void vmmci_stab_add(struct vmmci_stab *s, s64 raw, s64 phase, s64 offset);
+s64 vmmci_stab_tau0(const struct vmmci_stab *s);
+int vmmci_stab_dev(const struct vmmci_stab *s, int octave, s64 *adev_ppt,
+    s64 *tdev);
+
+#endif /* _VIRTIO_VMMCI_CORE_H */
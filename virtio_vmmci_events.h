@@ -0,0 +1,88 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef _VIRTIO_VMMCI_EVENTS_H
+#define _VIRTIO_VMMCI_EVENTS_H
+
+#include <linux/list.h>
+#include <linux/notifier.h>
+#include <linux/types.h>
+
+/* Events other drivers can subscribe to with vmmci_register_notifier().
+ * Subscribers are called in process context, highest priority first, before
+ * the driver acts on the host's request. They may sleep (e.g. to flush a
+ * write-back cache on SHUTDOWN) but must not (un)register notifiers from
+ * within their callback.
+ */
+enum vmmci_event {
+	VMMCI_EVENT_SHUTDOWN = 0,	/* host asked us to power off */
+	VMMCI_EVENT_REBOOT,		/* host asked us to reboot */
+	VMMCI_EVENT_SYNCRTC,		/* host asked us to sync the clock */
+	VMMCI_EVENT_SYNCED,		/* clock sync finished, see below */
+};
+
+/* Passed as the data for VMMCI_EVENT_SYNCED. The step is how far we moved
+ * CLOCK_REALTIME (0 if unknown, e.g. when syncing from the rtc) and the
+ * error is our bound on how far off the clock may still be, both in ns.
+ */
+struct vmmci_sync_info {
+	int result;
+	s64 step_ns;
+	s64 error_ns;
+};
+
+int vmmci_register_notifier(struct notifier_block *nb);
+int vmmci_unregister_notifier(struct notifier_block *nb);
+
+/* How a time source fared in the last vote between sources */
+enum vmmci_source_health {
+	VMMCI_SOURCE_UNKNOWN = 0,	/* not read yet */
+	VMMCI_SOURCE_OK,		/* agrees with the majority */
+	VMMCI_SOURCE_FALSETICKER,	/* outvoted by the majority */
+	VMMCI_SOURCE_NO_QUORUM,		/* no majority agrees on anything */
+	VMMCI_SOURCE_UNREACHABLE,	/* read() failed */
+};
+
+/* A clock other drivers (e.g. for a paravirt clock) can offer to check the
+ * host's time registers against with vmmci_register_source(). read() is
+ * called in process context on every drift measurement and fills in the
+ * source's time less CLOCK_REALTIME and a bound on its error, both in ns,
+ * returning 0 or a negative errno if the source can't be read right now.
+ * The clock is only ever stepped by a source a majority agrees with.
+ *
+ * The remaining fields are the driver's, for reporting in debugfs.
+ */
+struct vmmci_source {
+	const char *name;
+	int (*read)(struct vmmci_source *src, s64 *offset, s64 *error);
+
+	struct list_head node;
+	s64 offset;
+	s64 error;
+	enum vmmci_source_health health;
+	u64 reads;
+	u64 failures;
+	u64 falseticks;
+};
+
+int vmmci_register_source(struct vmmci_source *src);
+void vmmci_unregister_source(struct vmmci_source *src);
+
+#endif // _VIRTIO_VMMCI_EVENTS_H
@@ -0,0 +1,406 @@
+/*
+ *  Software loopback transport for the OpenBSD VMM control interface.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Pretends to be vmd(8)'s vmmci device so virtio_vmmci can be loaded,
+ * exercised and benchmarked on any Linux box. The "host" clock starts out
+ * at our CLOCK_REALTIME and then runs off CLOCK_MONOTONIC_RAW, so it
+ * doesn't follow the guest's own steps and slews. Its offset and rate skew
+ * are adjustable at runtime along with command injection via debugfs:
+ *
+ *   /sys/kernel/debug/vmmci_loopback/host_offset_ns  (rw) host less guest
+ *   /sys/kernel/debug/vmmci_loopback/skew_ppb        (rw) host rate error
+ *   /sys/kernel/debug/vmmci_loopback/command         (w)  send a command
+ *   /sys/kernel/debug/vmmci_loopback/exits           (r)  register accesses
+ *   /sys/kernel/debug/vmmci_loopback/acks            (r)  commands acked
+ *
+ * Each 32-bit register access counts as one vm exit and can be made to
+ * cost exit_cost_ns to mimic port i/o under vmm(4).
+ *
+ * Injecting a SHUTDOWN (1) or REBOOT (2) command does exactly what you'd
+ * expect to the machine running this!
+ */
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/version.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+
+#include "virtio_vmmci.h"
+
+static unsigned int exit_cost_ns = 0;
+module_param(exit_cost_ns, uint, 0644);
+MODULE_PARM_DESC(exit_cost_ns,
+    "Simulated cost of each 32-bit register access in ns (default 0)");
+
+struct vmmci_loopback {
+	struct virtio_device vdev;
+	struct platform_device *pdev;
+	struct dentry *debugfs;
+
+	spinlock_t lock;
+	u8 status;
+
+	/* The host clock, as its time at raw clock raw_base plus the raw
+	 * time since (and the skew on it), and its latched value from the
+	 * last TIME_SEC read
+	 */
+	s64 host_base;
+	s64 raw_base;
+	s32 skew_ppb;
+	s64 latched_sec;
+	s32 latched_nsec;
+
+	s32 cmd;
+	u64 exits;
+	u64 acks;
+};
+
+static struct vmmci_loopback *loopback;
+
+static struct vmmci_loopback *to_loopback(struct virtio_device *vdev)
+{
+	return container_of(vdev, struct vmmci_loopback, vdev);
+}
+
+/* Accounts for (and optionally burns the time of) a register access */
+static void lb_exit(struct vmmci_loopback *lb, unsigned int len)
+{
+	unsigned int n = DIV_ROUND_UP(len, 4);
+
+	lb->exits += n;
+	if (exit_cost_ns)
+		ndelay(n * exit_cost_ns);
+}
+
+/* Our pretend host's clock. The skew is applied to the raw time since the
+ * offset or skew was last changed, a second at a time so that with skews
+ * of up to a second per second the product fits in 64 bits.
+ */
+static s64 lb_host_now(struct vmmci_loopback *lb)
+{
+	s64 elapsed = ktime_get_raw_ns() - lb->raw_base;
+	s32 rem;
+	s64 sec = div_s64_rem(elapsed, NSEC_PER_SEC, &rem);
+
+	return lb->host_base + elapsed + sec * lb->skew_ppb
+	    + div_s64((s64) rem * lb->skew_ppb, NSEC_PER_SEC);
+}
+
+/* Where the host clock is against ours right now */
+static s64 lb_host_offset(struct vmmci_loopback *lb)
+{
+	unsigned long flags;
+	s64 offset;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	offset = lb_host_now(lb) - ktime_get_real_ns();
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	return offset;
+}
+
+static void lb_get(struct virtio_device *vdev, unsigned offset,
+    void *buf, unsigned len)
+{
+	struct vmmci_loopback *lb = to_loopback(vdev);
+	unsigned long flags;
+	s64 val = 0;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	lb_exit(lb, len);
+
+	switch (offset) {
+	case VMMCI_CONFIG_COMMAND:
+		val = lb->cmd;
+		break;
+
+	case VMMCI_CONFIG_TIME_SEC:
+		// Like vmd(8), latch the time on the seconds read
+		lb->latched_sec = div_s64_rem(lb_host_now(lb), NSEC_PER_SEC,
+		    &lb->latched_nsec);
+		val = lb->latched_sec;
+		break;
+
+	case VMMCI_CONFIG_TIME_USEC:
+		val = lb->latched_nsec / NSEC_PER_USEC;
+		break;
+	}
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	memcpy(buf, &val, min_t(unsigned, len, sizeof(val)));
+}
+
+static void lb_set(struct virtio_device *vdev, unsigned offset,
+    const void *buf, unsigned len)
+{
+	struct vmmci_loopback *lb = to_loopback(vdev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	lb_exit(lb, len);
+
+	// Writing back the command acks it, after which vmd(8) clears a
+	// SYNCRTC but leaves SHUTDOWN and REBOOT in place
+	if (offset == VMMCI_CONFIG_COMMAND && lb->cmd != VMMCI_NONE) {
+		lb->acks++;
+		if (lb->cmd == VMMCI_SYNCRTC)
+			lb->cmd = VMMCI_NONE;
+	}
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+
+static u8 lb_get_status(struct virtio_device *vdev)
+{
+	return to_loopback(vdev)->status;
+}
+
+static void lb_set_status(struct virtio_device *vdev, u8 status)
+{
+	to_loopback(vdev)->status = status;
+}
+
+static void lb_reset(struct virtio_device *vdev)
+{
+	to_loopback(vdev)->status = 0;
+}
+
+static u64 lb_get_features(struct virtio_device *vdev)
+{
+	return BIT_ULL(VMMCI_F_TIMESYNC) | BIT_ULL(VMMCI_F_ACK)
+	    | BIT_ULL(VMMCI_F_SYNCRTC);
+}
+
+static int lb_finalize_features(struct virtio_device *vdev)
+{
+	return 0;
+}
+
+static const char *lb_bus_name(struct virtio_device *vdev)
+{
+	return "loopback";
+}
+
+static const struct virtio_config_ops lb_config_ops = {
+	.get		= lb_get,
+	.set		= lb_set,
+	.get_status	= lb_get_status,
+	.set_status	= lb_set_status,
+	.reset		= lb_reset,
+	.get_features	= lb_get_features,
+	.finalize_features = lb_finalize_features,
+	.bus_name	= lb_bus_name,
+};
+
+/* Offsets and skews can be negative, which the debugfs attribute helpers
+ * won't parse (they take writes as unsigned), so these files read and
+ * write a signed value themselves.
+ */
+static ssize_t lb_read_s64(char __user *ubuf, size_t len, loff_t *ppos,
+    s64 val)
+{
+	char buf[24];
+	int n;
+
+	n = scnprintf(buf, sizeof(buf), "%lld\n", val);
+	return simple_read_from_buffer(ubuf, len, ppos, buf, n);
+}
+
+static ssize_t lb_write_s64(struct file *file, const char __user *ubuf,
+    size_t len, int (*set)(struct vmmci_loopback *, s64))
+{
+	long long val;
+	int rc;
+
+	rc = kstrtoll_from_user(ubuf, len, 0, &val);
+	if (rc)
+		return rc;
+
+	rc = set(file->private_data, val);
+	return rc ? rc : len;
+}
+
+static int host_offset_set(struct vmmci_loopback *lb, s64 val)
+{
+	unsigned long flags;
+
+	// Also restarts the skew so the host reads exactly this far ahead now
+	spin_lock_irqsave(&lb->lock, flags);
+	lb->raw_base = ktime_get_raw_ns();
+	lb->host_base = ktime_get_real_ns() + val;
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	return 0;
+}
+
+static ssize_t host_offset_read(struct file *file, char __user *ubuf,
+    size_t len, loff_t *ppos)
+{
+	struct vmmci_loopback *lb = file->private_data;
+
+	return lb_read_s64(ubuf, len, ppos, lb_host_offset(lb));
+}
+
+static ssize_t host_offset_write(struct file *file, const char __user *ubuf,
+    size_t len, loff_t *ppos)
+{
+	return lb_write_s64(file, ubuf, len, host_offset_set);
+}
+
+static const struct file_operations host_offset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= host_offset_read,
+	.write		= host_offset_write,
+	.llseek		= default_llseek,
+};
+
+static int skew_set(struct vmmci_loopback *lb, s64 val)
+{
+	unsigned long flags;
+
+	if (val > NSEC_PER_SEC || val < -NSEC_PER_SEC)
+		return -EINVAL;
+
+	// Fold the skew accumulated so far into the base and start over
+	spin_lock_irqsave(&lb->lock, flags);
+	lb->host_base = lb_host_now(lb);
+	lb->raw_base = ktime_get_raw_ns();
+	lb->skew_ppb = (s32) val;
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	return 0;
+}
+
+static ssize_t skew_read(struct file *file, char __user *ubuf, size_t len,
+    loff_t *ppos)
+{
+	struct vmmci_loopback *lb = file->private_data;
+
+	return lb_read_s64(ubuf, len, ppos, READ_ONCE(lb->skew_ppb));
+}
+
+static ssize_t skew_write(struct file *file, const char __user *ubuf,
+    size_t len, loff_t *ppos)
+{
+	return lb_write_s64(file, ubuf, len, skew_set);
+}
+
+static const struct file_operations skew_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= skew_read,
+	.write		= skew_write,
+	.llseek		= default_llseek,
+};
+
+static int command_set(void *data, u64 val)
+{
+	struct vmmci_loopback *lb = data;
+	unsigned long flags;
+
+	if (val > VMMCI_SYNCRTC)
+		return -EINVAL;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	lb->cmd = (s32) val;
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	// Our stand-in for raising the config change interrupt
+	virtio_config_changed(&lb->vdev);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(command_fops, NULL, command_set, "%llu\n");
+
+static void lb_release(struct device *dev)
+{
+	kfree(to_loopback(dev_to_virtio(dev)));
+}
+
+static int __init vmmci_loopback_init(void)
+{
+	struct vmmci_loopback *lb;
+	struct platform_device *pdev;
+	int rc;
+
+	pdev = platform_device_register_simple("vmmci-loopback", -1, NULL, 0);
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	lb = kzalloc(sizeof(*lb), GFP_KERNEL);
+	if (!lb) {
+		platform_device_unregister(pdev);
+		return -ENOMEM;
+	}
+	spin_lock_init(&lb->lock);
+	lb->pdev = pdev;
+	lb->raw_base = ktime_get_raw_ns();
+	lb->host_base = ktime_get_real_ns();
+	lb->vdev.id.vendor = PCI_VENDOR_ID_OPENBSD;
+	lb->vdev.id.device = VIRTIO_ID_VMMCI;
+	lb->vdev.config = &lb_config_ops;
+	lb->vdev.dev.parent = &pdev->dev;
+	lb->vdev.dev.release = lb_release;
+
+	lb->debugfs = debugfs_create_dir("vmmci_loopback", NULL);
+	debugfs_create_file("host_offset_ns", 0644, lb->debugfs, lb,
+	    &host_offset_fops);
+	debugfs_create_file("skew_ppb", 0644, lb->debugfs, lb, &skew_fops);
+	debugfs_create_file_unsafe("command", 0200, lb->debugfs, lb,
+	    &command_fops);
+	debugfs_create_u64("exits", 0444, lb->debugfs, &lb->exits);
+	debugfs_create_u64("acks", 0444, lb->debugfs, &lb->acks);
+
+	rc = register_virtio_device(&lb->vdev);
+	if (rc) {
+		printk(KERN_ERR "vmmci_loopback: failed to register device\n");
+		debugfs_remove_recursive(lb->debugfs);
+		put_device(&lb->vdev.dev);
+		platform_device_unregister(pdev);
+		return rc;
+	}
+
+	loopback = lb;
+	printk(KERN_INFO "vmmci_loopback: registered software vmmci device\n");
+	return 0;
+}
+
+static void __exit vmmci_loopback_exit(void)
+{
+	struct platform_device *pdev = loopback->pdev;
+
+	debugfs_remove_recursive(loopback->debugfs);
+	unregister_virtio_device(&loopback->vdev);
+	platform_device_unregister(pdev);
+}
+
+module_init(vmmci_loopback_init);
+module_exit(vmmci_loopback_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Software loopback transport for OpenBSD VMM Control Interface testing");
+MODULE_AUTHOR("Dave Voutila <voutilad@gmail.com>");
@@ -0,0 +1,2946 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <linux/completion.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/io.h>
+#include <linux/ioport.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/reboot.h>
+#include <linux/rtc.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/sysctl.h>
+#include <linux/time64.h>
+#include <linux/timex.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/wait.h>
+
+#include "virtio_vmmci.h"
+#ifdef VMMCI_HAVE_BPF_POLICY
+#include <linux/bpf.h>
+#include <linux/bpf_verifier.h>
+#include <linux/btf.h>
+#endif
+#include "virtio_vmmci_core.h"
+#include "virtio_vmmci_events.h"
+#include "virtio_vmmci_uapi.h"
+
+/* You can either change the global debug level here by changing the
+ * initialization value for "debug" or configure it at runtime via
+ * the kernel module parameter. See README.md for details.
+ */
+static int debug = 0;
+
+static int set_debug(const char *val, const struct kernel_param *kp)
+{
+	int n = 0, rc;
+	rc = kstrtoint(val, 10, &n);
+	if (rc || n < 0)
+		return -EINVAL;
+
+	return param_set_int(val, kp);
+}
+
+static int get_debug(char *buffer, const struct kernel_param *kp)
+{
+	int bytes;
+	bytes = snprintf(buffer, 1024, "%d\n", debug);
+	return bytes + 1; // account for NULL
+}
+
+static const struct kernel_param_ops debug_param_ops = {
+	.set	= set_debug,
+	.get	= get_debug,
+};
+
+module_param_cb(debug, &debug_param_ops, &debug, 0664);
+
+/* Offset (in milliseconds) beyond which a freshly measured drift is
+ * considered large enough to warrant a clock sync, e.g. after the guest
+ * resumes from suspend or hibernation.
+ */
+static unsigned int sync_threshold_ms = 1000;
+module_param(sync_threshold_ms, uint, 0644);
+MODULE_PARM_DESC(sync_threshold_ms,
+    "Resync the clock if drift exceeds this many milliseconds (default 1000)");
+
+/* Opt-in automatic stepping from the drift monitor for when the host
+ * doesn't tell us about a large jump (e.g. vmctl pause/unpause or a lost
+ * interrupt). A drift beyond autostep_threshold_ms has to be seen in
+ * autostep_confirm consecutive samples before we step, and it takes a
+ * drift under half the threshold to stand down again. We never step more
+ * than once per autostep_interval_s.
+ */
+static bool autostep = false;
+module_param(autostep, bool, 0644);
+MODULE_PARM_DESC(autostep, "Automatically step the clock on large drift (default off)");
+
+static unsigned int autostep_threshold_ms = 5000;
+module_param(autostep_threshold_ms, uint, 0644);
+MODULE_PARM_DESC(autostep_threshold_ms,
+    "Drift in milliseconds considered a large jump (default 5000)");
+
+static unsigned int autostep_confirm = 3;
+module_param(autostep_confirm, uint, 0644);
+MODULE_PARM_DESC(autostep_confirm,
+    "Consecutive samples needed to confirm a large jump (default 3)");
+
+static unsigned int autostep_interval_s = 300;
+module_param(autostep_interval_s, uint, 0644);
+MODULE_PARM_DESC(autostep_interval_s,
+    "Minimum seconds between automatic steps (default 300)");
+
+/* Publish our measured error bounds into the kernel's NTP state so things
+ * like timedatectl know how good (or bad) the clock is. We back off if a
+ * daemon is already disciplining the clock, see vmmci_ntp_daemon().
+ */
+static bool ntp_publish = true;
+module_param(ntp_publish, bool, 0644);
+MODULE_PARM_DESC(ntp_publish,
+    "Publish error bounds to the kernel NTP state (default on, built in only)");
+
+/* Windows (in seconds) over which we report MTIE, the worst peak to peak
+ * offset seen. See the debugfs stability file.
+ */
+static unsigned int mtie_windows_s[VMMCI_STAB_WINDOWS] = { 60, 300, 900, 3600 };
+static int mtie_windows_n = VMMCI_STAB_WINDOWS;
+module_param_array_named(mtie_windows_s, mtie_windows_s, uint,
+    &mtie_windows_n, 0444);
+MODULE_PARM_DESC(mtie_windows_s,
+    "Windows in seconds for MTIE reporting (default 60,300,900,3600)");
+
+/* Watch for host commands by polling in case the config change interrupt
+ * never arrives (e.g. a broken INTx route), which would otherwise turn a
+ * clean shutdown into vmd(8) killing us.
+ */
+static bool cmd_poll = true;
+module_param(cmd_poll, bool, 0444);
+MODULE_PARM_DESC(cmd_poll,
+    "Poll for host commands in case interrupts are lost (default on)");
+
+/* Small offsets found by the drift monitor can be slewed away (at the
+ * kernel's usual 500 ppm) instead of left alone. Like ntp_publish this needs
+ * do_adjtimex(), so it only works when built in.
+ */
+static unsigned int slew_max_us = 0;
+module_param(slew_max_us, uint, 0644);
+MODULE_PARM_DESC(slew_max_us,
+    "Slew away drift up to this many microseconds (default 0, off; built in only)");
+
+/* Only step (or slew) the clock by a time source that a majority of the
+ * sources we can read agree with. See vmmci_consensus().
+ */
+static bool consensus = true;
+module_param(consensus, bool, 0644);
+MODULE_PARM_DESC(consensus,
+    "Only correct the clock when a majority of time sources agree (default on)");
+
+/* A chunk of memory that survives a reboot, reserved like the one ramoops
+ * uses (e.g. with memmap=), where we keep a record of what we were doing
+ * for the next boot to look at. See struct vmmci_persist.
+ */
+static unsigned long pstore_addr = 0;
+module_param(pstore_addr, ulong, 0444);
+MODULE_PARM_DESC(pstore_addr,
+    "Physical address of a persistent region for telemetry (default 0, off)");
+
+static unsigned int pstore_size = 0;
+module_param(pstore_size, uint, 0444);
+MODULE_PARM_DESC(pstore_size, "Size of the persistent region in bytes");
+
+/* How old a saved estimator state (see struct vmmci_state) may be and still
+ * be taken up by a newly loaded driver.
+ */
+static unsigned int state_max_age_s = 3600;
+module_param(state_max_age_s, uint, 0644);
+MODULE_PARM_DESC(state_max_age_s,
+    "Oldest saved estimator state to restore, in seconds (default 3600)");
+
+/* Define our sysctl table entries for exposing our current clock
+ * drift in seconds and nanoseconds. (Avoid using floating point vals
+ * for now.)
+ */
+static int drift_sec = 0;
+static int drift_nsec = 0;
+
+/* ...and the error bounds and sync state that go with it, in the same units
+ * and meaning as adjtimex(2)'s maxerror, esterror and STA_UNSYNC.
+ */
+static int maxerror_us = NTP_PHASE_LIMIT;
+static int esterror_us = NTP_PHASE_LIMIT;
+static int unsynced = 1;
+
+static struct ctl_table_header *vmmci_table_header;
+
+static struct ctl_table drift_table[] = {
+	{
+		.procname	= "drift_sec",
+		.mode		= 0444,
+		.maxlen		= sizeof(int),
+		.data		= &drift_sec,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+		.procname	= "drift_nsec",
+		.mode		= 0444,
+		.maxlen		= sizeof(int),
+		.data		= &drift_nsec,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+		.procname	= "maxerror_us",
+		.mode		= 0444,
+		.maxlen		= sizeof(int),
+		.data		= &maxerror_us,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+		.procname	= "esterror_us",
+		.mode		= 0444,
+		.maxlen		= sizeof(int),
+		.data		= &esterror_us,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+		.procname	= "unsynced",
+		.mode		= 0444,
+		.maxlen		= sizeof(int),
+		.data		= &unsynced,
+		.proc_handler	= &proc_dointvec,
+	},
+	{ },
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+/*
+ * Removed in:
+ * https://github.com/torvalds/linux/commit/2f2665c13af4895b26761107c2f637c2f112d8e9
+ */
+static struct ctl_table vmmci_table = {
+	.procname	= "vmmci",
+	.child		= drift_table,
+};
+#endif
+
+/* A cross-timestamp of every guest clock we care about, in nanoseconds
+ * (except for the raw cycle counter). All of them describe the same instant
+ * so we can tell real oscillator drift apart from our own steps and slews
+ * (REALTIME) and suspends (BOOTTIME vs. MONOTONIC).
+ */
+struct vmmci_xstamp {
+	s64 real;
+	s64 mono;
+	s64 raw;
+	s64 boot;
+	u64 cycles;
+};
+
+/* A single filtered measurement of the host clock against the guest clocks.
+ * Guest clocks are taken at the midpoint of the window spent reading the
+ * host registers and the width is the size of that window (by the raw
+ * clock), giving us an error bound on the offset. The offset is always
+ * host time less guest REALTIME, in nanoseconds. Samples the other time
+ * sources outvoted are kept but left out of our frequency estimate.
+ */
+struct vmmci_sample {
+	s64 host;
+	struct vmmci_xstamp guest;
+	s64 offset;
+	s64 width;
+	bool outvoted;
+};
+
+/* What we know about config change interrupts, which sets how often the
+ * command poller runs.
+ */
+enum vmmci_irq_state {
+	VMMCI_IRQ_UNKNOWN = 0,	/* no commands yet */
+	VMMCI_IRQ_CONFIRMED,	/* an interrupt delivered a command */
+	VMMCI_IRQ_SUSPECT,	/* polling caught a command the irq missed */
+};
+
+static const char *vmmci_irq_states[] = {
+	"unknown", "confirmed", "suspect",
+};
+
+/* Operations the debugfs benchmark harness knows how to time */
+enum vmmci_bench_op {
+	VMMCI_BENCH_READ = 0,	/* a single command register read */
+	VMMCI_BENCH_SAMPLE,	/* a filtered drift sample */
+	VMMCI_BENCH_SYNC,	/* a full clock sync */
+	VMMCI_BENCH_CMD,	/* host interrupt to ack, for real commands */
+	VMMCI_BENCH_OPS,
+};
+
+static const char * const vmmci_bench_names[VMMCI_BENCH_OPS] = {
+	"read", "sample", "sync", "cmd",
+};
+
+/* Raw timings from the last run of an operation. For samples we also keep
+ * the bracket widths since those are our precision.
+ */
+struct vmmci_bench {
+	u64 *ns;
+	u64 *width;
+	unsigned int want;
+	unsigned int done;
+	u64 exits;	/* approximate, see vmmci_bench_run() */
+};
+
+struct virtio_vmmci {
+	struct virtio_device *vdev;
+
+	/* Used for monitoring clock drift. Needs scheduling. */
+	struct workqueue_struct *monitor_wq;
+	struct delayed_work monitor_work;
+
+	/* Withdraws our error bounds if the drift monitor falls silent */
+	struct delayed_work stale_work;
+
+	/* Used for synchronizing clock. Work is put on from
+	 * the general purpose queue from the interrupt handler.
+	 */
+	struct work_struct sync_work;
+
+	/* Commands from the host that still need subscribers notified and
+	 * acting on. Set from the interrupt handler.
+	 */
+	unsigned long pending_cmds;
+	struct work_struct cmd_work;
+
+	/* Serializes reading and acking the command register between the
+	 * interrupt handler and the command poller.
+	 */
+	spinlock_t cmd_lock;
+	enum vmmci_irq_state irq_state;
+
+	/* vmd(8) only clears SYNCRTC once acked, while SHUTDOWN and REBOOT
+	 * stay in the register. This is the last of those we handled, so
+	 * we don't act on (or ack) the same one again.
+	 */
+	s32 last_cmd;
+	bool poll_grace;
+	struct delayed_work poll_work;
+	u64 irq_cmds;
+	u64 polled_cmds;
+	u64 polls;
+
+	/* The last sample we recorded */
+	struct vmmci_sample last;
+	bool have_last;
+
+	/* Host time less CLOCK_BOOTTIME as of our first sample or last sync,
+	 * which a host suspend shows up against. Drift samples leave it be
+	 * so one landing between the resume and the sync doesn't hide it.
+	 */
+	s64 boot_ref;
+	bool have_boot_ref;
+
+	/* Only touched from the drift monitor, or with it stopped */
+	struct vmmci_autostep autostep;
+
+	/* Keeps syncs off the estimator state while it's being restored */
+	struct mutex sync_lock;
+
+	/* Recently accepted samples, exported via debugfs */
+	spinlock_t history_lock;
+	struct vmmci_sample history[VMMCI_HISTORY];
+	unsigned int history_next;
+
+	/* Host clock rate against our raw clock, fit over the history */
+	struct vmmci_core_point points[VMMCI_HISTORY];
+	s64 freq_ppb;
+	bool have_freq;
+
+	/* The host's time registers as one of the sources we vote between,
+	 * and the outcome of the last vote. Guarded by vmmci_sources_lock.
+	 */
+	struct vmmci_source regs_source;
+	struct list_head *sources;
+	int votes;
+	int voters;
+	s64 agree_lo;
+	s64 agree_hi;
+
+	/* ADEV, TDEV and MTIE over the drift monitor's samples */
+	struct vmmci_stab stab;
+	struct dentry *debugfs;
+
+	/* Where our records go, normally the /dev/vmmci stream */
+	struct vmmci_records *records;
+
+	/* Config space accesses so far, each one a vm exit under vmm(4) */
+	atomic64_t exits;
+
+	/* Results of the debugfs benchmark harness. Commands are timed as
+	 * they arrive, so this is also taken from the interrupt handler.
+	 */
+	spinlock_t bench_lock;
+	struct vmmci_bench bench[VMMCI_BENCH_OPS];
+};
+
+#ifndef MODULE
+/* When built into the kernel we sync the clock once more right before init
+ * starts, so we need to know when (and if) our device has been probed.
+ */
+static unsigned int boot_sync_timeout_ms = 2000;
+module_param(boot_sync_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(boot_sync_timeout_ms,
+    "Max time to wait on the device for the boot time sync (default 2000)");
+
+static DECLARE_COMPLETION(vmmci_probed);
+
+/* The probed device and whether the boot time sync gave up waiting on it,
+ * in which case the (late) probe syncs the clock itself.
+ */
+static DEFINE_MUTEX(vmmci_boot_lock);
+static struct virtio_vmmci *boot_vmmci;
+static bool boot_sync_missed;
+#endif
+
+static struct virtio_device_id id_table[] = {
+	{ VIRTIO_ID_VMMCI, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static unsigned int features[] = {
+	VMMCI_F_TIMESYNC, VMMCI_F_ACK, VMMCI_F_SYNCRTC,
+};
+
+/* Other drivers subscribed to host control events. We keep our own list
+ * rather than a plain notifier chain so we can time each subscriber.
+ */
+struct vmmci_subscriber {
+	struct list_head node;
+	struct notifier_block *nb;
+	u64 calls;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+static LIST_HEAD(vmmci_subscribers);
+static DEFINE_MUTEX(vmmci_subscribers_lock);
+
+int vmmci_register_notifier(struct notifier_block *nb)
+{
+	struct vmmci_subscriber *sub, *pos;
+
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub)
+		return -ENOMEM;
+	sub->nb = nb;
+
+	// Keep the list sorted by priority, first come first served on ties
+	mutex_lock(&vmmci_subscribers_lock);
+	list_for_each_entry(pos, &vmmci_subscribers, node) {
+		if (nb->priority > pos->nb->priority)
+			break;
+	}
+	list_add_tail(&sub->node, &pos->node);
+	mutex_unlock(&vmmci_subscribers_lock);
+
+	debug("registered notifier %ps\n", nb->notifier_call);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(vmmci_register_notifier);
+
+int vmmci_unregister_notifier(struct notifier_block *nb)
+{
+	struct vmmci_subscriber *sub;
+	int rc = -ENOENT;
+
+	mutex_lock(&vmmci_subscribers_lock);
+	list_for_each_entry(sub, &vmmci_subscribers, node) {
+		if (sub->nb == nb) {
+			list_del(&sub->node);
+			kfree(sub);
+			rc = 0;
+			break;
+		}
+	}
+	mutex_unlock(&vmmci_subscribers_lock);
+
+	return rc;
+}
+EXPORT_SYMBOL_GPL(vmmci_unregister_notifier);
+
+/* Calls each subscriber in priority order, stopping early if one asks */
+static int vmmci_call_notifiers(enum vmmci_event event, void *data)
+{
+	struct vmmci_subscriber *sub;
+	int rc = NOTIFY_DONE;
+	u64 start, elapsed;
+
+	mutex_lock(&vmmci_subscribers_lock);
+	list_for_each_entry(sub, &vmmci_subscribers, node) {
+		start = ktime_get_ns();
+		rc = sub->nb->notifier_call(sub->nb, event, data);
+		elapsed = ktime_get_ns() - start;
+
+		sub->calls++;
+		sub->total_ns += elapsed;
+		sub->max_ns = max(sub->max_ns, elapsed);
+
+		if (rc & NOTIFY_STOP_MASK)
+			break;
+	}
+	mutex_unlock(&vmmci_subscribers_lock);
+
+	return rc;
+}
+
+/* Time sources other than the host's registers, which always get a vote
+ * of their own on top of these.
+ */
+static LIST_HEAD(vmmci_sources);
+static DEFINE_MUTEX(vmmci_sources_lock);
+static int vmmci_nsources;
+
+static const char *vmmci_source_healths[] = {
+	"unknown", "ok", "falseticker", "no_quorum", "unreachable",
+};
+
+int vmmci_register_source(struct vmmci_source *src)
+{
+	int rc = 0;
+
+	mutex_lock(&vmmci_sources_lock);
+	if (vmmci_nsources == VMMCI_CORE_MAX_SOURCES - 1) {
+		rc = -ENOSPC;
+	} else {
+		src->health = VMMCI_SOURCE_UNKNOWN;
+		src->reads = src->failures = src->falseticks = 0;
+		list_add_tail(&src->node, &vmmci_sources);
+		vmmci_nsources++;
+	}
+	mutex_unlock(&vmmci_sources_lock);
+
+	if (rc == 0)
+		debug("registered time source %s\n", src->name);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(vmmci_register_source);
+
+void vmmci_unregister_source(struct vmmci_source *src)
+{
+	mutex_lock(&vmmci_sources_lock);
+	list_del(&src->node);
+	vmmci_nsources--;
+	mutex_unlock(&vmmci_sources_lock);
+}
+EXPORT_SYMBOL_GPL(vmmci_unregister_source);
+
+/* Records streamed to userspace via /dev/vmmci. These live outside of the
+ * device so an open file can't outlive them.
+ */
+struct vmmci_records {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct vmmci_record ring[VMMCI_RECORDS];
+	u64 next_seq;
+
+	/* Our record in the persistent region, if we have one */
+	struct vmmci_persist *persist;
+};
+
+static struct vmmci_records records = {
+	.lock = __SPIN_LOCK_UNLOCKED(records.lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(records.wait),
+};
+
+/* A copy of the record the last boot left in the persistent region. Ours
+ * hangs off the records, and is only touched under their lock.
+ */
+static struct {
+	struct vmmci_persist prev;
+	bool have_prev;
+
+	/* How much of the region we claimed and mapped */
+	size_t size;
+
+	/* Room for our estimator state right after the record, if the
+	 * region is big enough. Only touched from probe and remove.
+	 */
+	struct vmmci_state *state;
+} persist;
+
+/* Keeps a copy of a record in the persistent region, if we have one.
+ * Called with the records lock held.
+ */
+static void vmmci_persist_record(struct vmmci_records *r,
+    struct vmmci_record *rec)
+{
+	struct vmmci_persist *p = r->persist;
+	struct vmmci_record *slot;
+
+	if (p == NULL)
+		return;
+
+	switch (rec->type) {
+	case VMMCI_RECORD_SAMPLE:
+		slot = &p->samples[p->samples_next++ % VMMCI_PERSIST_SAMPLES];
+		break;
+	case VMMCI_RECORD_COMMAND:
+		slot = &p->commands[p->commands_next++
+		    % VMMCI_PERSIST_COMMANDS];
+		break;
+	default:
+		slot = &p->sync;
+		break;
+	}
+	*slot = *rec;
+
+	p->last_boot_ns = ktime_to_ns(ktime_get_boottime());
+	// Sync records don't otherwise say when they happened
+	if (slot->boot_ns == 0) {
+		slot->real_ns = ktime_get_real_ns();
+		slot->boot_ns = p->last_boot_ns;
+	}
+}
+
+/* Notes that we've reached a phase of shutting down */
+static void vmmci_persist_phase(struct vmmci_records *r,
+    enum vmmci_shutdown_phase phase)
+{
+	struct vmmci_persist *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	p = r->persist;
+	if (p) {
+		p->last_boot_ns = ktime_to_ns(ktime_get_boottime());
+		p->shutdown_boot_ns[phase] = p->last_boot_ns;
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+}
+
+/* Adds a record to the stream. Safe to call from interrupt context. */
+static void vmmci_push_record(struct vmmci_records *r,
+    struct vmmci_record *rec)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	rec->seq = r->next_seq++;
+	r->ring[rec->seq % VMMCI_RECORDS] = *rec;
+	vmmci_persist_record(r, rec);
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	wake_up_interruptible(&r->wait);
+}
+
+static int records_open(struct inode *inode, struct file *file)
+{
+	u64 *next;
+
+	next = kzalloc(sizeof(*next), GFP_KERNEL);
+	if (!next)
+		return -ENOMEM;
+
+	// New readers start with whatever is still buffered
+	spin_lock_irq(&records.lock);
+	if (records.next_seq > VMMCI_RECORDS)
+		*next = records.next_seq - VMMCI_RECORDS;
+	spin_unlock_irq(&records.lock);
+
+	file->private_data = next;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,3,0)
+	return nonseekable_open(inode, file);
+#else
+	return stream_open(inode, file);
+#endif
+}
+
+static int records_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static bool records_ready(u64 *next)
+{
+	bool ready;
+
+	spin_lock_irq(&records.lock);
+	ready = *next < records.next_seq;
+	spin_unlock_irq(&records.lock);
+
+	return ready;
+}
+
+static ssize_t records_read(struct file *file, char __user *buf,
+    size_t count, loff_t *ppos)
+{
+	u64 *next = file->private_data;
+	struct vmmci_record rec;
+	ssize_t copied = 0;
+	int rc;
+
+	if (count < sizeof(rec))
+		return -EINVAL;
+
+	if (!records_ready(next)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		rc = wait_event_interruptible(records.wait, records_ready(next));
+		if (rc)
+			return rc;
+	}
+
+	while (count - copied >= sizeof(rec)) {
+		spin_lock_irq(&records.lock);
+		if (*next >= records.next_seq) {
+			spin_unlock_irq(&records.lock);
+			break;
+		}
+		if (records.next_seq - *next > VMMCI_RECORDS)
+			*next = records.next_seq - VMMCI_RECORDS;
+		rec = records.ring[*next % VMMCI_RECORDS];
+		(*next)++;
+		spin_unlock_irq(&records.lock);
+
+		if (copy_to_user(buf + copied, &rec, sizeof(rec)))
+			return copied ? copied : -EFAULT;
+		copied += sizeof(rec);
+	}
+
+	return copied;
+}
+
+static __poll_t records_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &records.wait, wait);
+
+	return records_ready(file->private_data) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations records_fops = {
+	.owner		= THIS_MODULE,
+	.open		= records_open,
+	.release	= records_release,
+	.read		= records_read,
+	.poll		= records_poll,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
+	.llseek		= no_llseek,
+#endif
+};
+
+static struct miscdevice records_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= VMMCI_DEVICE_NAME,
+	.fops		= &records_fops,
+	.mode		= 0444,
+};
+
+/* Whether we managed to register /dev/vmmci. There's one records ring for
+ * the module, so there's one device for it too, however many vmmci devices
+ * get probed.
+ */
+static bool have_records_dev;
+
+/* Takes an atomic snapshot of all the guest clocks. The kernel gives us
+ * REALTIME, MONOTONIC_RAW and the cycle counter from a single clocksource
+ * read and we derive the rest from the timekeeper offsets, retrying if the
+ * clock was set while we were looking.
+ */
+static void vmmci_xstamp(struct vmmci_xstamp *x)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	x->cycles = get_cycles();
+	x->real = ktime_get_real_ns();
+	x->mono = ktime_get_ns();
+	x->raw = ktime_to_ns(ktime_get_raw());
+	x->boot = ktime_to_ns(ktime_get_boottime());
+#else
+	struct system_time_snapshot snap;
+	ktime_t offs_real, offs_boot;
+
+	do {
+		offs_real = ktime_mono_to_real(0);
+		offs_boot = ktime_mono_to_any(0, TK_OFFS_BOOT);
+		ktime_get_snapshot(&snap);
+	} while (offs_real != ktime_mono_to_real(0)
+	    || offs_boot != ktime_mono_to_any(0, TK_OFFS_BOOT));
+
+	x->cycles = snap.cycles;
+	x->real = ktime_to_ns(snap.real);
+	x->raw = ktime_to_ns(snap.raw);
+	x->mono = x->real - ktime_to_ns(offs_real);
+	x->boot = x->mono + ktime_to_ns(offs_boot);
+#endif
+}
+
+/* Config space accessors. Every access of up to 32 bits traps out to
+ * vmd(8), so we keep count of them.
+ */
+static void vmmci_cread(struct virtio_vmmci *vmmci, unsigned int offset,
+    void *buf, unsigned int len)
+{
+	atomic64_add(DIV_ROUND_UP(len, 4), &vmmci->exits);
+	vmmci->vdev->config->get(vmmci->vdev, offset, buf, len);
+}
+
+static void vmmci_cwrite(struct virtio_vmmci *vmmci, unsigned int offset,
+    const void *buf, unsigned int len)
+{
+	atomic64_add(DIV_ROUND_UP(len, 4), &vmmci->exits);
+	vmmci->vdev->config->set(vmmci->vdev, offset, buf, len);
+}
+
+/* Reads the host clock from the config registers, bracketing the reads
+ * with guest clock readings. We do this a few times and let the core pick
+ * the most trustworthy read.
+ */
+static void vmmci_take_sample(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	struct vmmci_sample reads[VMMCI_SAMPLE_READS], *read;
+	s64 offsets[VMMCI_SAMPLE_READS], widths[VMMCI_SAMPLE_READS];
+	struct vmmci_xstamp before, after;
+	s64 sec, usec;
+	int i;
+
+	for (i = 0; i < VMMCI_SAMPLE_READS; i++) {
+		read = &reads[i];
+
+		vmmci_xstamp(&before);
+		vmmci_cread(vmmci, VMMCI_CONFIG_TIME_SEC, &sec, sizeof(sec));
+		vmmci_cread(vmmci, VMMCI_CONFIG_TIME_USEC, &usec, sizeof(usec));
+		vmmci_xstamp(&after);
+
+		read->host = sec * NSEC_PER_SEC + usec * NSEC_PER_USEC;
+		read->width = after.raw - before.raw;
+		read->guest.real = before.real + ((after.real - before.real) >> 1);
+		read->guest.mono = before.mono + ((after.mono - before.mono) >> 1);
+		read->guest.raw = before.raw + (read->width >> 1);
+		read->guest.boot = before.boot + ((after.boot - before.boot) >> 1);
+		read->guest.cycles = before.cycles
+		    + ((after.cycles - before.cycles) >> 1);
+		read->offset = read->host - read->guest.real;
+
+		offsets[i] = read->offset;
+		widths[i] = read->width;
+	}
+
+	*sample = reads[vmmci_core_pick(offsets, widths, VMMCI_SAMPLE_READS,
+	    VMMCI_SAMPLE_TOLERANCE)];
+}
+
+/* Refits our frequency estimate to the history. Called with the history
+ * lock held.
+ */
+static void vmmci_refit(struct virtio_vmmci *vmmci)
+{
+	struct vmmci_core_point *pt;
+	struct vmmci_sample *sample;
+	unsigned int i, n, first, m = 0;
+
+	// The core wants the points oldest first
+	n = min_t(unsigned int, vmmci->history_next, VMMCI_HISTORY);
+	first = vmmci->history_next - n;
+	for (i = 0; i < n; i++) {
+		sample = &vmmci->history[(first + i) % VMMCI_HISTORY];
+		if (sample->outvoted)
+			continue;
+		pt = &vmmci->points[m++];
+		pt->raw = sample->guest.raw;
+		pt->phase = sample->host - pt->raw;
+	}
+	vmmci->have_freq = vmmci_core_freq(vmmci->points, m,
+	    &vmmci->freq_ppb) == 0;
+}
+
+/* Keeps a copy of an accepted sample in our history and refreshes our
+ * frequency estimate from it.
+ */
+static void vmmci_store_sample(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	spin_lock(&vmmci->history_lock);
+	vmmci->history[vmmci->history_next % VMMCI_HISTORY] = *sample;
+	vmmci->history_next++;
+	vmmci_refit(vmmci);
+	spin_unlock(&vmmci->history_lock);
+}
+
+/* Converts samples to and from the records we stream and save */
+static void vmmci_sample_to_record(const struct vmmci_sample *sample,
+    struct vmmci_record *rec)
+{
+	rec->type = VMMCI_RECORD_SAMPLE;
+	rec->host_ns = sample->host;
+	rec->real_ns = sample->guest.real;
+	rec->mono_ns = sample->guest.mono;
+	rec->raw_ns = sample->guest.raw;
+	rec->boot_ns = sample->guest.boot;
+	rec->cycles = sample->guest.cycles;
+	rec->offset_ns = sample->offset;
+	rec->width_ns = sample->width;
+	rec->flags = sample->outvoted ? VMMCI_RECORD_F_OUTVOTED : 0;
+}
+
+static void vmmci_record_to_sample(const struct vmmci_record *rec,
+    struct vmmci_sample *sample)
+{
+	sample->host = rec->host_ns;
+	sample->guest.real = rec->real_ns;
+	sample->guest.mono = rec->mono_ns;
+	sample->guest.raw = rec->raw_ns;
+	sample->guest.boot = rec->boot_ns;
+	sample->guest.cycles = rec->cycles;
+	sample->offset = rec->offset_ns;
+	sample->width = rec->width_ns;
+	sample->outvoted = rec->flags & VMMCI_RECORD_F_OUTVOTED;
+}
+
+/* The kernel only exports do_adjtimex() to built in code. As a module, the
+ * sysctls are all we can offer and it's up to userspace to apply them.
+ */
+#ifndef MODULE
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
+static bool vmmci_ntp_daemon(struct timex *tx)
+#else
+static bool vmmci_ntp_daemon(struct __kernel_timex *tx)
+#endif
+{
+	// ntpd and timesyncd run the kernel PLL (or FLL). chronyd doesn't, but
+	// it does steer the frequency and, with rtcsync, clears STA_UNSYNC,
+	// neither of which we ever do ourselves.
+	return (tx->status & (STA_PLL | STA_FLL)) ||
+	    !(tx->status & STA_UNSYNC) || tx->freq != 0;
+}
+
+/* Only the error bounds are published. STA_UNSYNC is left to NTP daemons:
+ * clearing it would also start the kernel's 11 minute RTC write back (see
+ * sync_hw_clock()), which isn't ours to turn on.
+ */
+static void vmmci_ntp_apply(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
+	struct timex tx = { .modes = 0 };
+#else
+	struct __kernel_timex tx = { .modes = 0 };
+#endif
+
+	// Read the current state first so we can leave a daemon's alone
+	if (do_adjtimex(&tx) < 0 || vmmci_ntp_daemon(&tx))
+		return;
+
+	tx.modes = ADJ_MAXERROR | ADJ_ESTERROR;
+	tx.maxerror = maxerror_us;
+	tx.esterror = esterror_us;
+
+	if (do_adjtimex(&tx) < 0)
+		debug("failed to update kernel ntp state\n");
+}
+
+/* Gradually corrects the clock by an offset, like adjtime(3) */
+static int vmmci_slew(s64 offset)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
+	struct timex tx = { .modes = 0 };
+#else
+	struct __kernel_timex tx = { .modes = 0 };
+#endif
+	int rc;
+
+	if (do_adjtimex(&tx) < 0 || vmmci_ntp_daemon(&tx))
+		return -EBUSY;
+
+	tx.modes = ADJ_OFFSET_SINGLESHOT;
+	tx.offset = div_s64(offset, NSEC_PER_USEC);
+	rc = do_adjtimex(&tx);
+
+	return rc < 0 ? rc : 0;
+}
+#else
+static void vmmci_ntp_apply(void)
+{
+}
+
+static int vmmci_slew(s64 offset)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* Publishes error bounds for the guest clock. Without a fresh sample (or
+ * with one that says we're way off) the clock is flagged as unsynchronized.
+ */
+static void vmmci_publish_error(struct vmmci_sample *sample)
+{
+	s64 err;
+
+	if (sample == NULL) {
+		maxerror_us = esterror_us = NTP_PHASE_LIMIT;
+		unsynced = 1;
+	} else {
+		err = abs(sample->offset);
+		esterror_us = min_t(s64, err / NSEC_PER_USEC, NTP_PHASE_LIMIT);
+		maxerror_us = min_t(s64, (err + (sample->width >> 1))
+		    / NSEC_PER_USEC + 1, NTP_PHASE_LIMIT);
+		unsynced = err > (s64) sync_threshold_ms * NSEC_PER_MSEC;
+	}
+
+	if (ntp_publish)
+		vmmci_ntp_apply();
+}
+
+/* Records the offset of a sample in our drift sysctls */
+static void vmmci_record_drift(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	struct timespec64 diff = ns_to_timespec64(sample->offset);
+	struct vmmci_record rec = { 0 };
+
+	// XXX: our globals for tracking drift...since we're not SMP enabled let's
+	// ignore locking/unlocking for now...also yes, we're blindly going from a
+	// s64 to an int here.
+	drift_sec = diff.tv_sec;
+	drift_nsec = diff.tv_nsec;
+
+	debug("current clock drift: " TIME_FMT " seconds (+/- %lld ns)\n",
+	    diff.tv_sec, diff.tv_nsec, sample->width >> 1);
+
+	vmmci->last = *sample;
+	vmmci->have_last = true;
+	if (!vmmci->have_boot_ref) {
+		vmmci->boot_ref = sample->host - sample->guest.boot;
+		vmmci->have_boot_ref = true;
+	}
+	vmmci_store_sample(vmmci, sample);
+
+	vmmci_sample_to_record(sample, &rec);
+	vmmci_push_record(vmmci->records, &rec);
+
+	vmmci_publish_error(sample);
+}
+
+/* Fills in the core's policy knobs from our module parameters */
+static void vmmci_params(struct vmmci_core_params *p)
+{
+	p->sync_threshold = (s64) sync_threshold_ms * NSEC_PER_MSEC;
+	p->autostep_threshold = autostep
+	    ? (s64) autostep_threshold_ms * NSEC_PER_MSEC : 0;
+	p->autostep_confirm = autostep_confirm;
+	p->autostep_interval = (s64) autostep_interval_s * NSEC_PER_SEC;
+	p->slew_max = (s64) slew_max_us * NSEC_PER_USEC;
+}
+
+/* Returns true if the sample's offset is beyond what our policy tolerates */
+static bool vmmci_needs_sync(struct vmmci_sample *sample)
+{
+	struct vmmci_core_params p;
+
+	vmmci_params(&p);
+	return vmmci_core_needs_sync(&p, sample->offset);
+}
+
+/* Takes and records a fresh drift sample, returning true if the clock
+ * should be synchronized.
+ */
+static bool vmmci_check_drift(struct virtio_vmmci *vmmci)
+{
+	struct vmmci_sample sample;
+
+	vmmci_take_sample(vmmci, &sample);
+	vmmci_record_drift(vmmci, &sample);
+	if (!vmmci_needs_sync(&sample))
+		return false;
+
+	log("measured drift of %lld ms, synchronizing clock\n",
+	    sample.offset / NSEC_PER_MSEC);
+	return true;
+}
+
+#ifdef VMMCI_RTC_DEVICE
+/* The rtc only counts whole seconds and vmd(8) ticks its emulated one off
+ * its own timer rather than the host's second boundary, so allow for a
+ * whole second either side of the middle of the second it reports.
+ */
+static int vmmci_rtc_read(struct vmmci_source *src, s64 *offset, s64 *error)
+{
+	struct rtc_device *rtc;
+	struct rtc_time tm;
+	s64 before, after;
+	int rc;
+
+	rtc = rtc_class_open(VMMCI_RTC_DEVICE);
+	if (rtc == NULL)
+		return -ENODEV;
+
+	before = ktime_get_real_ns();
+	rc = rtc_read_time(rtc, &tm);
+	after = ktime_get_real_ns();
+	rtc_class_close(rtc);
+	if (rc)
+		return rc;
+
+	*offset = rtc_tm_to_time64(&tm) * NSEC_PER_SEC + (NSEC_PER_SEC >> 1)
+	    - (before + ((after - before) >> 1));
+	*error = NSEC_PER_SEC + ((after - before) >> 1);
+	return 0;
+}
+
+static struct vmmci_source vmmci_rtc_source = {
+	.name = "rtc",
+	.read = vmmci_rtc_read,
+};
+#endif
+
+/* Reads every time source and votes on what time it is by intersecting
+ * their error bounds. The host's registers take part when we're given a
+ * fresh sample of them. Returns the health of the source we're asking
+ * about, which is only ok if a strict majority of the sources we could read
+ * agree with it, so a single bad source can't outvote the rest. When it's
+ * the only source we could read at all, it wins by default.
+ */
+static enum vmmci_source_health vmmci_consensus(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample, struct vmmci_source *by)
+{
+	struct vmmci_source *srcs[VMMCI_CORE_MAX_SOURCES], *src;
+	s64 offsets[VMMCI_CORE_MAX_SOURCES], errors[VMMCI_CORE_MAX_SOURCES];
+	bool agree[VMMCI_CORE_MAX_SOURCES];
+	enum vmmci_source_health health;
+	int i, n = 0;
+
+	mutex_lock(&vmmci_sources_lock);
+	if (sample) {
+		// The registers only have microseconds
+		src = &vmmci->regs_source;
+		src->reads++;
+		src->offset = sample->offset;
+		src->error = (sample->width >> 1) + NSEC_PER_USEC;
+		srcs[n++] = src;
+	}
+
+	list_for_each_entry(src, vmmci->sources, node) {
+		src->reads++;
+		if (src->read(src, &src->offset, &src->error)) {
+			src->failures++;
+			src->health = VMMCI_SOURCE_UNREACHABLE;
+			continue;
+		}
+		srcs[n++] = src;
+	}
+
+	for (i = 0; i < n; i++) {
+		offsets[i] = srcs[i]->offset;
+		errors[i] = srcs[i]->error;
+	}
+	vmmci->voters = n;
+	vmmci->votes = vmmci_core_intersect(offsets, errors, n, agree,
+	    &vmmci->agree_lo, &vmmci->agree_hi);
+
+	for (i = 0; i < n; i++) {
+		if (vmmci->votes * 2 <= n) {
+			srcs[i]->health = VMMCI_SOURCE_NO_QUORUM;
+		} else if (agree[i]) {
+			srcs[i]->health = VMMCI_SOURCE_OK;
+		} else {
+			srcs[i]->health = VMMCI_SOURCE_FALSETICKER;
+			srcs[i]->falseticks++;
+			debug("time source %s is off by %lld ms from the majority\n",
+			    srcs[i]->name, srcs[i]->offset / NSEC_PER_MSEC);
+		}
+	}
+	health = by->health;
+	mutex_unlock(&vmmci_sources_lock);
+
+	return health;
+}
+
+/* Returns true if we may step the clock by a source, i.e. it's one of a
+ * majority of sources that agree or we've been told not to care.
+ */
+static bool vmmci_may_step(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample, struct vmmci_source *by)
+{
+	enum vmmci_source_health health;
+
+	health = vmmci_consensus(vmmci, sample, by);
+	if (health == VMMCI_SOURCE_OK || !consensus)
+		return true;
+
+	log("time source %s is %s, not stepping the clock\n", by->name,
+	    vmmci_source_healths[health]);
+	return false;
+}
+
+/* Synchronizes the system time to the hardware clock (rtc). Uses a process
+ * similar to the one performed by the kernel at startup as defined in
+ * the Linux kernel source file /drivers/rtc/hctosys.c. Minus the 32-bit
+ * and non-amd64 specific stuff.
+ */
+#ifdef VMMCI_RTC_DEVICE
+static int sync_system_time(struct virtio_vmmci *vmmci)
+{
+	int rc = -1;
+	struct rtc_time hw_tm;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
+	struct timespec time = {
+#else
+	struct timespec64 time = {
+#endif
+		.tv_nsec = NSEC_PER_SEC >> 1,
+	};
+
+	// Try to open the hardware clock...which should be the emulated
+	// mc146818 clock device.
+	struct rtc_device *rtc = rtc_class_open(VMMCI_RTC_DEVICE);
+	if (rtc == NULL) {
+		printk(KERN_ERR "vmmci unable to open rtc device\n");
+		rc = -ENODEV;
+		goto end;
+	}
+
+	if (!vmmci_may_step(vmmci, NULL, &vmmci_rtc_source)) {
+		rc = -EAGAIN;
+		goto close;
+	}
+
+	// Reading the rtc device should be the same as getting the host
+	// time via the vmmci config registers...just without all the
+	// nastiness
+	rc = rtc_read_time(rtc, &hw_tm);
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to read the hardware clock\n");
+		goto close;
+	}
+
+	// Setting the system clock using do_settimeofday64 should be safe
+	// as it is similar to OpenBSD's tc_setclock that steps the system
+	// clock while triggering any alarms/timeouts that should fire
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
+	rtc_tm_to_time(&hw_tm, &time.tv_sec);
+	rc = do_settimeofday(&time);
+#else
+	time.tv_sec = rtc_tm_to_time64(&hw_tm);
+	rc = do_settimeofday64(&time);
+#endif
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to set system clock to rtc!\n");
+		goto close;
+	}
+	log("set system clock to %d-%02d-%02d %02d:%02d:%02d UTC\n",
+	    hw_tm.tm_year + 1900, hw_tm.tm_mon + 1, hw_tm.tm_mday,
+	    hw_tm.tm_hour, hw_tm.tm_min, hw_tm.tm_sec);
+
+close:
+	// I assume this cleans up any references, if the kernel tracks them
+	rtc_class_close(rtc);
+
+end:
+	return rc;
+}
+#else
+static int sync_system_time(struct virtio_vmmci *vmmci)
+{
+	debug("no known rtc device available");
+	return -1;
+}
+#endif
+
+/* When the host suspends we're frozen right along with it and none of our
+ * clocks move. Stepping CLOCK_REALTIME alone leaves CLOCK_BOOTTIME thinking
+ * no time passed, so timers based on it trickle out long after they should
+ * have fired. Instead, work out how far the host moved relative to our boot
+ * time since the last sync and inject that as sleep time, just like the
+ * kernel does after a real suspend.
+ */
+static s64 vmmci_sleep_gap(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	s64 gap;
+
+	if (!vmmci->have_boot_ref)
+		return 0;
+
+	gap = sample->host - sample->guest.boot - vmmci->boot_ref;
+
+	// Only account for what's also missing from the wall clock, otherwise
+	// we'd just have to step it back afterwards.
+	gap = min(gap, sample->offset);
+	if (gap <= (s64) sync_threshold_ms * NSEC_PER_MSEC)
+		return 0;
+
+	return gap;
+}
+
+/* Returns true if any sleep time was injected */
+static bool vmmci_inject_sleep(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	s64 gap = vmmci_sleep_gap(vmmci, sample);
+
+	if (gap == 0)
+		return false;
+
+#ifdef VMMCI_HAVE_SLEEPTIME
+	{
+		struct timespec64 delta = ns_to_timespec64(gap);
+
+		timekeeping_inject_sleeptime64(&delta);
+		log("injected %lld ms of host suspend as sleep time\n",
+		    gap / NSEC_PER_MSEC);
+		return true;
+	}
+#else
+	log("host was suspended for %lld ms, but CLOCK_BOOTTIME can only be "
+	    "corrected when built into the kernel\n", gap / NSEC_PER_MSEC);
+	return false;
+#endif
+}
+
+/* Steps the system clock by the offset measured against the host's config
+ * registers. Unlike the rtc this gets us microsecond precision instead of
+ * whole seconds.
+ */
+static int sync_from_host(struct virtio_vmmci *vmmci,
+    struct vmmci_sync_info *info)
+{
+	struct vmmci_sample sample;
+	struct timespec64 time;
+	int rc;
+
+	vmmci_take_sample(vmmci, &sample);
+	if (!vmmci_may_step(vmmci, &sample, &vmmci->regs_source)) {
+		vmmci_publish_error(NULL);
+		return -EAGAIN;
+	}
+	if (vmmci_inject_sleep(vmmci, &sample)) {
+		// Whatever we step by still needs the other sources' backing
+		vmmci_take_sample(vmmci, &sample);
+		if (!vmmci_may_step(vmmci, &sample, &vmmci->regs_source)) {
+			vmmci_publish_error(NULL);
+			return -EAGAIN;
+		}
+	}
+
+	time = ns_to_timespec64(ktime_get_real_ns() + sample.offset);
+	rc = do_settimeofday64(&time);
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to set system clock to host time!\n");
+		vmmci_publish_error(NULL);
+		return rc;
+	}
+	log("stepped system clock by %lld us (+/- %lld ns)\n",
+	    sample.offset / NSEC_PER_USEC, sample.width >> 1);
+	info->step_ns = sample.offset;
+	info->error_ns = sample.width >> 1;
+
+	// Our clocks now agree with the host again, so start measuring any
+	// future suspend from here.
+	vmmci_take_sample(vmmci, &sample);
+	vmmci_record_drift(vmmci, &sample);
+	vmmci->boot_ref = sample.host - sample.guest.boot;
+
+	return 0;
+}
+
+/* Prefer the host's time registers, falling back to the rtc if the host
+ * doesn't advertise them.
+ */
+static int vmmci_sync(struct virtio_vmmci *vmmci)
+{
+	struct vmmci_sync_info info = { 0 };
+	struct vmmci_record rec = { 0 };
+	u64 start = ktime_get_raw_ns();
+
+	mutex_lock(&vmmci->sync_lock);
+	if (virtio_has_feature(vmmci->vdev, VMMCI_F_TIMESYNC))
+		info.result = sync_from_host(vmmci, &info);
+	else
+		info.result = sync_system_time(vmmci);
+	mutex_unlock(&vmmci->sync_lock);
+
+	rec.type = VMMCI_RECORD_SYNC;
+	rec.duration_ns = ktime_get_raw_ns() - start;
+	rec.offset_ns = info.step_ns;
+	rec.width_ns = info.error_ns;
+	rec.result = info.result;
+	vmmci_push_record(vmmci->records, &rec);
+
+	vmmci_call_notifiers(VMMCI_EVENT_SYNCED, &info);
+	return info.result;
+}
+
+static void sync_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+	int rc = 0;
+
+	vmmci = container_of(work, struct virtio_vmmci, sync_work);
+
+	debug("starting clock synchronization...");
+	rc = vmmci_sync(vmmci);
+	if (rc)
+		debug("clock synchronization failed (%d)\n", rc);
+	else
+		debug("finished clock synchronization!\n");
+
+}
+
+/* Lets subscribers know about each pending host command before acting on
+ * it. Runs in process context since subscribers may need to sleep.
+ */
+static void cmd_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+
+	vmmci = container_of(work, struct virtio_vmmci, cmd_work);
+
+	if (test_and_clear_bit(VMMCI_SYNCRTC, &vmmci->pending_cmds)) {
+		vmmci_call_notifiers(VMMCI_EVENT_SYNCRTC, NULL);
+		schedule_work(&vmmci->sync_work);
+	}
+
+	if (test_and_clear_bit(VMMCI_SHUTDOWN, &vmmci->pending_cmds)) {
+		vmmci_call_notifiers(VMMCI_EVENT_SHUTDOWN, NULL);
+		vmmci_persist_phase(vmmci->records, VMMCI_SHUTDOWN_NOTIFIED);
+		orderly_poweroff(false);
+	}
+
+	if (test_and_clear_bit(VMMCI_REBOOT, &vmmci->pending_cmds)) {
+		vmmci_call_notifiers(VMMCI_EVENT_REBOOT, NULL);
+		vmmci_persist_phase(vmmci->records, VMMCI_SHUTDOWN_NOTIFIED);
+		orderly_reboot();
+	}
+}
+
+#ifdef VMMCI_HAVE_BPF_POLICY
+/* A sync policy supplied at runtime as BPF struct_ops. Callbacks that are
+ * left out fall back to the built-in policy.
+ */
+struct vmmci_policy_ops {
+	/* Returns false to throw a sample away */
+	bool (*accept)(s64 offset, s64 width);
+
+	/* Returns an enum vmmci_core_action, or < 0 to use the default */
+	int (*decide)(s64 offset, s64 width, s64 freq_ppb);
+
+	/* Returns the ms until the next sample, or 0 to use the default */
+	u32 (*interval_ms)(s64 offset, int action);
+
+	char name[16];
+};
+
+static struct vmmci_policy_ops __rcu *vmmci_policy;
+static DEFINE_MUTEX(vmmci_policy_lock);
+
+static bool vmmci_policy_accept(struct vmmci_sample *sample)
+{
+	struct vmmci_policy_ops *ops;
+	bool accept = true;
+
+	rcu_read_lock();
+	ops = rcu_dereference(vmmci_policy);
+	if (ops && ops->accept)
+		accept = ops->accept(sample->offset, sample->width);
+	rcu_read_unlock();
+
+	return accept;
+}
+
+static int vmmci_policy_decide(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	struct vmmci_policy_ops *ops;
+	int action = -1;
+
+	rcu_read_lock();
+	ops = rcu_dereference(vmmci_policy);
+	if (ops && ops->decide)
+		action = ops->decide(sample->offset, sample->width,
+		    vmmci->have_freq ? vmmci->freq_ppb : 0);
+	rcu_read_unlock();
+
+	if (action > VMMCI_CORE_STEP) {
+		debug("ignoring bogus policy action %d\n", action);
+		action = VMMCI_CORE_NONE;
+	}
+	return action;
+}
+
+static u32 vmmci_policy_interval(struct vmmci_sample *sample, int action)
+{
+	struct vmmci_policy_ops *ops;
+	u32 ms = 0;
+
+	rcu_read_lock();
+	ops = rcu_dereference(vmmci_policy);
+	if (ops && ops->interval_ms)
+		ms = ops->interval_ms(sample->offset, action);
+	rcu_read_unlock();
+
+	return ms;
+}
+
+static int vmmci_policy_reg(void *kdata, struct bpf_link *link)
+{
+	struct vmmci_policy_ops *ops = kdata;
+	int rc = 0;
+
+	mutex_lock(&vmmci_policy_lock);
+	if (rcu_access_pointer(vmmci_policy))
+		rc = -EEXIST;
+	else
+		rcu_assign_pointer(vmmci_policy, ops);
+	mutex_unlock(&vmmci_policy_lock);
+
+	if (rc == 0)
+		log("sync policy '%s' attached\n", ops->name);
+	return rc;
+}
+
+static void vmmci_policy_unreg(void *kdata, struct bpf_link *link)
+{
+	struct vmmci_policy_ops *ops = kdata;
+
+	mutex_lock(&vmmci_policy_lock);
+	if (rcu_access_pointer(vmmci_policy) == ops)
+		RCU_INIT_POINTER(vmmci_policy, NULL);
+	mutex_unlock(&vmmci_policy_lock);
+
+	synchronize_rcu();
+	log("sync policy '%s' detached\n", ops->name);
+}
+
+static int vmmci_policy_init_member(const struct btf_type *t,
+    const struct btf_member *member, void *kdata, const void *udata)
+{
+	const struct vmmci_policy_ops *uops = udata;
+	struct vmmci_policy_ops *ops = kdata;
+
+	if (__btf_member_bit_offset(t, member) / 8
+	    != offsetof(struct vmmci_policy_ops, name))
+		return 0;
+
+	if (strscpy(ops->name, uops->name, sizeof(ops->name)) <= 0)
+		return -EINVAL;
+	return 1;
+}
+
+static int vmmci_policy_btf_init(struct btf *btf)
+{
+	return 0;
+}
+
+static bool vmmci_policy_is_valid_access(int off, int size,
+    enum bpf_access_type type, const struct bpf_prog *prog,
+    struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_verifier_ops vmmci_policy_verifier_ops = {
+	.is_valid_access = vmmci_policy_is_valid_access,
+};
+
+/* Stand-ins the kernel needs for CFI. Never actually called. */
+static bool vmmci_policy_accept_stub(s64 offset, s64 width)
+{
+	return true;
+}
+
+static int vmmci_policy_decide_stub(s64 offset, s64 width, s64 freq_ppb)
+{
+	return -1;
+}
+
+static u32 vmmci_policy_interval_stub(s64 offset, int action)
+{
+	return 0;
+}
+
+static struct vmmci_policy_ops vmmci_policy_stubs = {
+	.accept = vmmci_policy_accept_stub,
+	.decide = vmmci_policy_decide_stub,
+	.interval_ms = vmmci_policy_interval_stub,
+};
+
+static struct bpf_struct_ops bpf_vmmci_policy_ops = {
+	.verifier_ops = &vmmci_policy_verifier_ops,
+	.init = vmmci_policy_btf_init,
+	.init_member = vmmci_policy_init_member,
+	.reg = vmmci_policy_reg,
+	.unreg = vmmci_policy_unreg,
+	.cfi_stubs = &vmmci_policy_stubs,
+	.name = "vmmci_policy_ops",
+	.owner = THIS_MODULE,
+};
+
+/* Without BTF for the module there's nothing for BPF programs to attach to,
+ * but that's no reason not to load.
+ */
+static void vmmci_policy_register(void)
+{
+	int rc = register_bpf_struct_ops(&bpf_vmmci_policy_ops,
+	    vmmci_policy_ops);
+
+	if (rc)
+		printk(KERN_WARNING "vmmci: BPF sync policies unavailable (%d)\n",
+		    rc);
+}
+#else
+static bool vmmci_policy_accept(struct vmmci_sample *sample)
+{
+	return true;
+}
+
+static int vmmci_policy_decide(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	return -1;
+}
+
+static u32 vmmci_policy_interval(struct vmmci_sample *sample, int action)
+{
+	return 0;
+}
+
+static void vmmci_policy_register(void)
+{
+}
+#endif
+
+/* Runs our guest/host clock drift measurements and logs them to the syslog */
+/* Decides what the drift monitor should do about a sample, by the policy
+ * and then by what the other time sources make of it.
+ */
+static int vmmci_monitor_decide(struct virtio_vmmci *vmmci,
+    struct vmmci_sample *sample)
+{
+	struct vmmci_core_params params;
+	struct vmmci_autostep autostep = vmmci->autostep;
+	int action;
+
+	action = vmmci_policy_decide(vmmci, sample);
+	if (action < 0) {
+		vmmci_params(&params);
+		action = vmmci_core_decide(&params, &vmmci->autostep,
+		    sample->offset, sample->guest.boot);
+	}
+
+	// Only ever correct the clock by registers the other sources back up.
+	// A step we don't take mustn't count against the rate limit either,
+	// so the next sample over threshold can step once they do.
+	if (sample->outvoted && action == VMMCI_CORE_STEP) {
+		log("host time registers lack a quorum, not stepping the clock\n");
+		vmmci->autostep = autostep;
+	}
+	if (sample->outvoted && action > VMMCI_CORE_SUSPECT)
+		action = VMMCI_CORE_NONE;
+
+	return action;
+}
+
+static void monitor_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+	struct vmmci_sample sample;
+	unsigned long delay = DELAY_20s;
+	bool fresh = false;
+	int action;
+	u32 ms;
+
+	debug("measuring clock drift...\n");
+
+	// My god this container_of stuff seems...messy? Oh, Linux...
+	vmmci = container_of((struct delayed_work *) work, struct virtio_vmmci, monitor_work);
+
+	vmmci_take_sample(vmmci, &sample);
+	debug("host clock: %lld, guest clock: %lld\n", sample.host,
+	    sample.guest.real);
+	if (!vmmci_policy_accept(&sample)) {
+		debug("sync policy rejected sample\n");
+		action = VMMCI_CORE_NONE;
+		goto out;
+	}
+	sample.outvoted = consensus && vmmci_consensus(vmmci, &sample,
+	    &vmmci->regs_source) != VMMCI_SOURCE_OK;
+	vmmci_record_drift(vmmci, &sample);
+	fresh = true;
+
+	spin_lock(&vmmci->history_lock);
+	vmmci_stab_add(&vmmci->stab, sample.guest.raw,
+	    sample.host - sample.guest.raw, sample.offset);
+	spin_unlock(&vmmci->history_lock);
+
+	action = vmmci_monitor_decide(vmmci, &sample);
+
+	switch (action) {
+	case VMMCI_CORE_SUSPECT:
+		debug("large drift seen %u time(s), confirming\n",
+		    vmmci->autostep.confirmed);
+		delay = DELAY_1s;
+		break;
+	case VMMCI_CORE_STEP:
+		log("confirmed drift of %lld ms, synchronizing clock\n",
+		    sample.offset / NSEC_PER_MSEC);
+		schedule_work(&vmmci->sync_work);
+		break;
+	case VMMCI_CORE_SLEW:
+		if (vmmci_slew(sample.offset))
+			debug("unable to slew the clock\n");
+		else
+			debug("slewing clock by %lld us\n",
+			    sample.offset / NSEC_PER_USEC);
+		break;
+	default:
+		break;
+	}
+
+out:
+	ms = vmmci_policy_interval(&sample, action);
+	if (ms)
+		delay = msecs_to_jiffies(clamp_t(u32, ms, 100, 3600 * 1000));
+
+	// The bounds we just published hold until a few samples go missing
+	if (fresh)
+		mod_delayed_work(system_power_efficient_wq, &vmmci->stale_work,
+		    VMMCI_STALE_SAMPLES * delay);
+
+	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, delay);
+	debug("drift measurement routine finished\n");
+}
+
+/* We've gone a while without a sample (e.g. the guest was paused, or the
+ * policy keeps turning them down), so make sure nobody trusts our last
+ * published bounds in the meantime.
+ */
+static void stale_work_func(struct work_struct *work)
+{
+	debug("no fresh drift sample, withdrawing error bounds\n");
+	vmmci_publish_error(NULL);
+}
+
+/* Dumps our sample history, oldest first, one sample per line */
+static int samples_show(struct seq_file *m, void *v)
+{
+	struct virtio_vmmci *vmmci = m->private;
+	struct vmmci_sample *sample;
+	unsigned int i, first = 0;
+
+	seq_puts(m, "# host real mono raw boot cycles offset width\n");
+
+	spin_lock(&vmmci->history_lock);
+	if (vmmci->have_freq)
+		seq_printf(m, "# freq_ppb %lld\n", vmmci->freq_ppb);
+	if (vmmci->history_next > VMMCI_HISTORY)
+		first = vmmci->history_next - VMMCI_HISTORY;
+	for (i = first; i < vmmci->history_next; i++) {
+		sample = &vmmci->history[i % VMMCI_HISTORY];
+		seq_printf(m, "%lld %lld %lld %lld %lld %llu %lld %lld\n",
+		    sample->host, sample->guest.real, sample->guest.mono,
+		    sample->guest.raw, sample->guest.boot,
+		    (unsigned long long) sample->guest.cycles,
+		    sample->offset, sample->width);
+	}
+	spin_unlock(&vmmci->history_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(samples);
+
+/* Dumps clock stability stats for the drift monitor's samples. Deviations
+ * are only meaningful at a steady sampling interval, so treat anything
+ * computed across autostep confirmations or policy interval changes with
+ * some suspicion.
+ */
+static int stability_show(struct seq_file *m, void *v)
+{
+	struct virtio_vmmci *vmmci = m->private;
+	struct vmmci_stab *s = &vmmci->stab;
+	s64 tau0, adev, tdev;
+	int i;
+
+	spin_lock(&vmmci->history_lock);
+	tau0 = vmmci_stab_tau0(s);
+	seq_printf(m, "# samples %llu tau0_ms %lld\n", s->n,
+	    tau0 / NSEC_PER_MSEC);
+
+	seq_puts(m, "# tau_ms adev_ppt tdev_ns\n");
+	for (i = 0; i < VMMCI_STAB_OCTAVES; i++) {
+		if (vmmci_stab_dev(s, i, &adev, &tdev))
+			break;
+		seq_printf(m, "%lld %lld %lld\n", (tau0 << i) / NSEC_PER_MSEC,
+		    adev, tdev);
+	}
+
+	seq_puts(m, "# window_s mtie_ns\n");
+	for (i = 0; i < VMMCI_STAB_WINDOWS && s->window[i]; i++)
+		seq_printf(m, "%lld %lld\n", s->window[i] / NSEC_PER_SEC,
+		    s->mtie[i]);
+	spin_unlock(&vmmci->history_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stability);
+
+/* Dumps what each time source said in the last vote and how it's fared */
+static void sources_print(struct seq_file *m, struct vmmci_source *src)
+{
+	seq_printf(m, "%s %lld %lld %s %llu %llu %llu\n", src->name,
+	    src->offset, src->error, vmmci_source_healths[src->health],
+	    src->reads, src->failures, src->falseticks);
+}
+
+static int sources_show(struct seq_file *m, void *v)
+{
+	struct virtio_vmmci *vmmci = m->private;
+	struct vmmci_source *src;
+
+	mutex_lock(&vmmci_sources_lock);
+	seq_printf(m, "# agree %d of %d between %lld and %lld\n",
+	    vmmci->votes, vmmci->voters, vmmci->agree_lo, vmmci->agree_hi);
+	seq_puts(m, "# name offset_ns error_ns health reads failures "
+	    "falseticks\n");
+	sources_print(m, &vmmci->regs_source);
+	list_for_each_entry(src, vmmci->sources, node)
+		sources_print(m, src);
+	mutex_unlock(&vmmci_sources_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sources);
+
+/* Dumps what the last boot left in the persistent region, if anything */
+static int previous_show(struct seq_file *m, void *v)
+{
+	struct vmmci_persist *p = &persist.prev;
+	struct vmmci_record *rec;
+	u64 i, first;
+
+	if (!persist.have_prev)
+		return 0;
+
+	seq_printf(m, "loads %u\n", p->loads);
+	seq_printf(m, "loaded_real_ns %lld\n", p->loaded_real_ns);
+	seq_printf(m, "last_boot_ns %lld\n", p->last_boot_ns);
+	seq_printf(m, "shutdown_boot_ns %lld %lld %lld\n",
+	    p->shutdown_boot_ns[VMMCI_SHUTDOWN_REQUESTED],
+	    p->shutdown_boot_ns[VMMCI_SHUTDOWN_NOTIFIED],
+	    p->shutdown_boot_ns[VMMCI_SHUTDOWN_KERNEL]);
+
+	seq_puts(m, "# sample host real boot offset width\n");
+	first = p->samples_next > VMMCI_PERSIST_SAMPLES
+	    ? p->samples_next - VMMCI_PERSIST_SAMPLES : 0;
+	for (i = first; i < p->samples_next; i++) {
+		rec = &p->samples[i % VMMCI_PERSIST_SAMPLES];
+		seq_printf(m, "sample %lld %lld %lld %lld %lld\n", rec->host_ns,
+		    rec->real_ns, rec->boot_ns, rec->offset_ns, rec->width_ns);
+	}
+
+	seq_puts(m, "# command cmd real boot flags\n");
+	first = p->commands_next > VMMCI_PERSIST_COMMANDS
+	    ? p->commands_next - VMMCI_PERSIST_COMMANDS : 0;
+	for (i = first; i < p->commands_next; i++) {
+		rec = &p->commands[i % VMMCI_PERSIST_COMMANDS];
+		seq_printf(m, "command %u %lld %lld %u\n", rec->cmd,
+		    rec->real_ns, rec->boot_ns, rec->flags);
+	}
+
+	seq_puts(m, "# sync result real boot step error duration\n");
+	rec = &p->sync;
+	if (rec->type)
+		seq_printf(m, "sync %d %lld %lld %lld %lld %lld\n", rec->result,
+		    rec->real_ns, rec->boot_ns, rec->offset_ns, rec->width_ns,
+		    rec->duration_ns);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(previous);
+
+/* Dumps timing stats for each subscriber, in the order they're called */
+static int notifiers_show(struct seq_file *m, void *v)
+{
+	struct vmmci_subscriber *sub;
+
+	seq_puts(m, "# callback priority calls total_ns max_ns\n");
+
+	mutex_lock(&vmmci_subscribers_lock);
+	list_for_each_entry(sub, &vmmci_subscribers, node) {
+		seq_printf(m, "%ps %d %llu %llu %llu\n", sub->nb->notifier_call,
+		    sub->nb->priority, sub->calls, sub->total_ns, sub->max_ns);
+	}
+	mutex_unlock(&vmmci_subscribers_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(notifiers);
+
+/* Reports how commands have been reaching us */
+static int commands_show(struct seq_file *m, void *v)
+{
+	struct virtio_vmmci *vmmci = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vmmci->cmd_lock, flags);
+	seq_printf(m, "interrupts %s\n", vmmci_irq_states[vmmci->irq_state]);
+	seq_printf(m, "irq_cmds %llu\n", vmmci->irq_cmds);
+	seq_printf(m, "polled_cmds %llu\n", vmmci->polled_cmds);
+	seq_printf(m, "polls %llu\n", vmmci->polls);
+	spin_unlock_irqrestore(&vmmci->cmd_lock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(commands);
+
+/* Counts a host command toward an armed "cmd" benchmark, if there is one */
+static void vmmci_bench_cmd(struct virtio_vmmci *vmmci, u64 ns, u64 exits)
+{
+	struct vmmci_bench *b = &vmmci->bench[VMMCI_BENCH_CMD];
+	unsigned long flags;
+
+	spin_lock_irqsave(&vmmci->bench_lock, flags);
+	if (b->done < b->want) {
+		b->ns[b->done++] = ns;
+		b->exits += exits;
+	}
+	spin_unlock_irqrestore(&vmmci->bench_lock, flags);
+}
+
+/* Replaces the results for an operation, freeing the old ones */
+static void vmmci_bench_swap(struct virtio_vmmci *vmmci,
+    enum vmmci_bench_op op, struct vmmci_bench *fresh)
+{
+	struct vmmci_bench old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vmmci->bench_lock, flags);
+	old = vmmci->bench[op];
+	vmmci->bench[op] = *fresh;
+	spin_unlock_irqrestore(&vmmci->bench_lock, flags);
+
+	kvfree(old.ns);
+	kvfree(old.width);
+}
+
+/* Times n back to back runs of an operation. We can't make the host send
+ * us commands, so for those we just arm the harness to time the next n.
+ * Exits are counted off the device-wide total, so any drift monitor run
+ * or command poll that lands mid-run is charged to it as well.
+ */
+static int vmmci_bench_run(struct virtio_vmmci *vmmci,
+    enum vmmci_bench_op op, unsigned int n)
+{
+	struct vmmci_bench b = { .want = n };
+	struct vmmci_sample sample;
+	s64 exits;
+	u64 start;
+	s32 cmd;
+	int rc = 0;
+
+	b.ns = kvcalloc(n, sizeof(*b.ns), GFP_KERNEL);
+	if (op == VMMCI_BENCH_SAMPLE)
+		b.width = kvcalloc(n, sizeof(*b.width), GFP_KERNEL);
+	if (!b.ns || (op == VMMCI_BENCH_SAMPLE && !b.width)) {
+		kvfree(b.ns);
+		kvfree(b.width);
+		return -ENOMEM;
+	}
+
+	for (; op != VMMCI_BENCH_CMD && b.done < n; b.done++) {
+		exits = atomic64_read(&vmmci->exits);
+		start = ktime_get_raw_ns();
+
+		switch (op) {
+		case VMMCI_BENCH_READ:
+			vmmci_cread(vmmci, VMMCI_CONFIG_COMMAND, &cmd,
+			    sizeof(cmd));
+			break;
+		case VMMCI_BENCH_SAMPLE:
+			vmmci_take_sample(vmmci, &sample);
+			b.width[b.done] = sample.width;
+			break;
+		default:
+			rc = vmmci_sync(vmmci);
+			break;
+		}
+
+		b.ns[b.done] = ktime_get_raw_ns() - start;
+		b.exits += atomic64_read(&vmmci->exits) - exits;
+		if (rc)
+			break;
+		cond_resched();
+	}
+
+	vmmci_bench_swap(vmmci, op, &b);
+	return rc;
+}
+
+static int vmmci_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts a run's timings and prints its min, median, 99th percentile, max
+ * and (if we have them) vm exits per operation. The percentile is the
+ * nearest-rank one, the smallest timing at least 99% of the run is under.
+ */
+static void vmmci_bench_print(struct seq_file *m, const char *name,
+    u64 *v, unsigned int n, unsigned int want, s64 exits)
+{
+	u64 per_op;
+	u32 frac;
+
+	sort(v, n, sizeof(*v), vmmci_bench_cmp, NULL);
+	seq_printf(m, "%s %u/%u %llu %llu %llu %llu", name, n, want, v[0],
+	    v[n / 2], v[(n * 99 + 99) / 100 - 1], v[n - 1]);
+
+	if (exits < 0) {
+		seq_puts(m, " -\n");
+		return;
+	}
+	per_op = div_u64_rem(div_u64((u64) exits * 100, n), 100, &frac);
+	seq_printf(m, " %llu.%02u\n", per_op, frac);
+}
+
+/* Dumps the results of the last run of each operation, in nanoseconds */
+static int bench_show(struct seq_file *m, void *v)
+{
+	struct virtio_vmmci *vmmci = m->private;
+	struct vmmci_bench *b;
+	unsigned long flags;
+	unsigned int i, n, want;
+	u64 *ns, *width;
+	s64 exits;
+
+	seq_puts(m, "# op n/want min median p99 max exits_per_op\n");
+
+	for (i = 0; i < VMMCI_BENCH_OPS; i++) {
+		b = &vmmci->bench[i];
+
+		// Copy the results out since commands can still be landing
+		spin_lock_irqsave(&vmmci->bench_lock, flags);
+		want = b->want;
+		spin_unlock_irqrestore(&vmmci->bench_lock, flags);
+		if (want == 0)
+			continue;
+
+		ns = kvcalloc(want, sizeof(*ns), GFP_KERNEL);
+		width = kvcalloc(want, sizeof(*width), GFP_KERNEL);
+		if (!ns || !width) {
+			kvfree(ns);
+			kvfree(width);
+			return -ENOMEM;
+		}
+
+		spin_lock_irqsave(&vmmci->bench_lock, flags);
+		n = min(b->done, want);
+		want = b->want;
+		exits = b->exits;
+		if (b->ns)
+			memcpy(ns, b->ns, n * sizeof(*ns));
+		if (b->width)
+			memcpy(width, b->width, n * sizeof(*width));
+		spin_unlock_irqrestore(&vmmci->bench_lock, flags);
+
+		if (n > 0) {
+			vmmci_bench_print(m, vmmci_bench_names[i], ns, n, want,
+			    exits);
+			if (i == VMMCI_BENCH_SAMPLE)
+				vmmci_bench_print(m, "sample_width", width, n,
+				    want, -1);
+		} else
+			seq_printf(m, "%s 0/%u\n", vmmci_bench_names[i], want);
+
+		kvfree(ns);
+		kvfree(width);
+	}
+
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, inode->i_private);
+}
+
+/* Takes "<op> <iterations>", e.g. "sample 1000", and runs it */
+static ssize_t bench_write(struct file *file, const char __user *ubuf,
+    size_t count, loff_t *ppos)
+{
+	struct virtio_vmmci *vmmci;
+	char buf[32], name[8];
+	unsigned int n;
+	int op, rc;
+
+	vmmci = ((struct seq_file *) file->private_data)->private;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%7s %u", name, &n) != 2 || n == 0
+	    || n > VMMCI_BENCH_MAX)
+		return -EINVAL;
+	op = match_string(vmmci_bench_names, VMMCI_BENCH_OPS, name);
+	if (op < 0)
+		return op;
+	if (op == VMMCI_BENCH_SYNC && n > VMMCI_BENCH_SYNC_MAX)
+		return -EINVAL;
+
+	rc = vmmci_bench_run(vmmci, op, n);
+	return rc ? rc : count;
+}
+
+static const struct file_operations bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bench_open,
+	.read		= seq_read,
+	.write		= bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Counts clocksource changes. Raw clock readings taken on another
+ * clocksource come from another oscillator, so our frequency estimate
+ * wouldn't carry over.
+ */
+static u32 vmmci_cs_seq(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	return 0;
+#else
+	struct system_time_snapshot snap;
+
+	ktime_get_snapshot(&snap);
+	return snap.cs_was_changed_seq;
+#endif
+}
+
+static u32 vmmci_state_csum(struct vmmci_state *st)
+{
+	u32 csum, saved = st->csum;
+
+	st->csum = 0;
+	csum = crc32_le(~0, (const void *) st, sizeof(*st));
+	st->csum = saved;
+
+	return csum;
+}
+
+/* Captures what the drift estimator has learned so far */
+static void vmmci_state_save(struct virtio_vmmci *vmmci,
+    struct vmmci_state *st)
+{
+	struct vmmci_xstamp now;
+	unsigned int i, first;
+
+	memset(st, 0, sizeof(*st));
+	st->magic = VMMCI_STATE_MAGIC;
+	st->version = VMMCI_STATE_VERSION;
+	st->size = sizeof(*st);
+
+	vmmci_xstamp(&now);
+	st->saved_real_ns = now.real;
+	st->saved_boot_ns = now.boot;
+	st->saved_raw_ns = now.raw;
+	st->cs_seq = vmmci_cs_seq();
+
+	st->autostep_confirmed = vmmci->autostep.confirmed;
+	st->autostep_last_step = vmmci->autostep.last_step;
+	st->autostep_stepped = vmmci->autostep.stepped;
+
+	spin_lock(&vmmci->history_lock);
+	st->nsamples = min_t(unsigned int, vmmci->history_next,
+	    min(VMMCI_HISTORY, VMMCI_STATE_SAMPLES));
+	first = vmmci->history_next - st->nsamples;
+	for (i = 0; i < st->nsamples; i++)
+		vmmci_sample_to_record(&vmmci->history[(first + i)
+		    % VMMCI_HISTORY], &st->samples[i]);
+	st->freq_ppb = vmmci->freq_ppb;
+	st->have_freq = vmmci->have_freq;
+	spin_unlock(&vmmci->history_lock);
+
+	st->csum = vmmci_state_csum(st);
+}
+
+/* Checks that a saved state is intact and still applies: saved in this
+ * boot not too long ago, on the same clocksource, and against a host clock
+ * that's still where the saved samples say it should be. Returns 0 or a
+ * negative errno saying why not.
+ */
+static int vmmci_state_check(struct virtio_vmmci *vmmci,
+    struct vmmci_state *st)
+{
+	struct vmmci_sample sample, last;
+	struct vmmci_xstamp now;
+	s64 epoch, predicted;
+
+	if (st->magic != VMMCI_STATE_MAGIC
+	    || st->version != VMMCI_STATE_VERSION || st->size != sizeof(*st)
+	    || st->nsamples == 0 || st->nsamples > VMMCI_STATE_SAMPLES)
+		return -EINVAL;
+	if (vmmci_state_csum(st) != st->csum)
+		return -EBADMSG;
+
+	// A reboot starts the boot clock over but not the wall clock, which
+	// moves the wall clock time of boot on by at least the old uptime.
+	vmmci_xstamp(&now);
+	epoch = (now.real - now.boot) - (st->saved_real_ns - st->saved_boot_ns);
+	if (now.boot < st->saved_boot_ns || now.raw < st->saved_raw_ns
+	    || abs(epoch) > st->saved_boot_ns >> 1)
+		return -ESTALE;
+	if (now.boot - st->saved_boot_ns > (s64) state_max_age_s * NSEC_PER_SEC)
+		return -ESTALE;
+	if (st->cs_seq != vmmci_cs_seq())
+		return -ESTALE;
+
+	vmmci_take_sample(vmmci, &sample);
+	vmmci_record_to_sample(&st->samples[st->nsamples - 1], &last);
+	predicted = last.host - last.guest.raw;
+	if (st->have_freq)
+		predicted += div_s64(div_s64(sample.guest.raw - last.guest.raw,
+		    NSEC_PER_USEC) * st->freq_ppb, USEC_PER_SEC);
+	if (abs(sample.host - sample.guest.raw - predicted)
+	    > VMMCI_STATE_TOLERANCE)
+		return -ESTALE;
+
+	return 0;
+}
+
+/* Seeds the drift estimator from a saved state, keeping anything we've
+ * sampled ourselves since on top. The caller makes sure the drift monitor
+ * isn't running.
+ */
+static int vmmci_state_load(struct virtio_vmmci *vmmci,
+    struct vmmci_state *st)
+{
+	struct vmmci_sample *merged;
+	unsigned int i, ours, theirs, first;
+	int rc;
+
+	rc = vmmci_state_check(vmmci, st);
+	if (rc)
+		return rc;
+
+	merged = kmalloc_array(VMMCI_HISTORY, sizeof(*merged), GFP_KERNEL);
+	if (merged == NULL)
+		return -ENOMEM;
+
+	spin_lock(&vmmci->history_lock);
+	ours = min_t(unsigned int, vmmci->history_next, VMMCI_HISTORY);
+	theirs = min(st->nsamples, VMMCI_HISTORY - ours);
+	first = st->nsamples - theirs;
+	for (i = 0; i < theirs; i++)
+		vmmci_record_to_sample(&st->samples[first + i], &merged[i]);
+	first = vmmci->history_next - ours;
+	for (i = 0; i < ours; i++)
+		merged[theirs + i] = vmmci->history[(first + i) % VMMCI_HISTORY];
+
+	memcpy(vmmci->history, merged, (theirs + ours) * sizeof(*merged));
+	vmmci->history_next = theirs + ours;
+	vmmci_refit(vmmci);
+	spin_unlock(&vmmci->history_lock);
+
+	if (!vmmci->have_last && theirs) {
+		vmmci->last = merged[theirs - 1];
+		vmmci->have_last = true;
+	}
+	if (!vmmci->autostep.stepped) {
+		vmmci->autostep.confirmed = st->autostep_confirmed;
+		vmmci->autostep.last_step = st->autostep_last_step;
+		vmmci->autostep.stepped = st->autostep_stepped;
+	}
+	kfree(merged);
+
+	log("restored %u samples of estimator state saved %lld s ago\n",
+	    theirs, (ktime_to_ns(ktime_get_boottime()) - st->saved_boot_ns)
+	    / NSEC_PER_SEC);
+	return 0;
+}
+
+/* Reading the state file gives a snapshot of the estimator taken on open.
+ * Writing one back, in full, takes it in if it still applies.
+ */
+struct vmmci_state_file {
+	struct virtio_vmmci *vmmci;
+	struct vmmci_state st;
+};
+
+static int state_open(struct inode *inode, struct file *file)
+{
+	struct vmmci_state_file *sf;
+
+	sf = kvzalloc(sizeof(*sf), GFP_KERNEL);
+	if (sf == NULL)
+		return -ENOMEM;
+
+	sf->vmmci = inode->i_private;
+	if (file->f_mode & FMODE_READ)
+		vmmci_state_save(sf->vmmci, &sf->st);
+	file->private_data = sf;
+
+	return 0;
+}
+
+static ssize_t state_read(struct file *file, char __user *ubuf, size_t len,
+    loff_t *ppos)
+{
+	struct vmmci_state_file *sf = file->private_data;
+
+	return simple_read_from_buffer(ubuf, len, ppos, &sf->st,
+	    sizeof(sf->st));
+}
+
+static ssize_t state_write(struct file *file, const char __user *ubuf,
+    size_t len, loff_t *ppos)
+{
+	struct vmmci_state_file *sf = file->private_data;
+	struct virtio_vmmci *vmmci = sf->vmmci;
+	ssize_t n;
+	int rc;
+
+	n = simple_write_to_buffer(&sf->st, sizeof(sf->st), ppos, ubuf, len);
+	if (n <= 0 || *ppos < sizeof(sf->st))
+		return n;
+
+	// Keep the drift monitor and syncs off the history meanwhile. Host
+	// commands can queue a sync at any time, so those wait on the lock.
+	cancel_delayed_work_sync(&vmmci->monitor_work);
+	mutex_lock(&vmmci->sync_lock);
+	rc = vmmci_state_load(vmmci, &sf->st);
+	mutex_unlock(&vmmci->sync_lock);
+	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, DELAY_20s);
+
+	return rc ? rc : n;
+}
+
+static int state_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations state_fops = {
+	.owner		= THIS_MODULE,
+	.open		= state_open,
+	.read		= state_read,
+	.write		= state_write,
+	.llseek		= default_llseek,
+	.release	= state_release,
+};
+
+/* Reads, dispatches and acks a host command. This runs from both the
+ * interrupt handler and the command poller, so the register is read and
+ * acked under cmd_lock to make sure a command is only handled once.
+ */
+static void vmmci_handle_cmd(struct virtio_vmmci *vmmci, bool polled)
+{
+	struct virtio_device *vdev = vmmci->vdev;
+	struct vmmci_record rec = { 0 };
+	u64 start = ktime_get_raw_ns();
+	s64 exits = atomic64_read(&vmmci->exits);
+	unsigned long flags;
+	s32 cmd = 0;
+	debug("reading command register...\n");
+
+	spin_lock_irqsave(&vmmci->cmd_lock, flags);
+	vmmci_cread(vmmci, VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
+
+	if (cmd != VMMCI_NONE && cmd == vmmci->last_cmd) {
+		spin_unlock_irqrestore(&vmmci->cmd_lock, flags);
+		debug("command %d already handled\n", cmd);
+		return;
+	}
+	WRITE_ONCE(vmmci->last_cmd, cmd == VMMCI_SHUTDOWN
+	    || cmd == VMMCI_REBOOT ? cmd : VMMCI_NONE);
+
+	if (cmd != VMMCI_NONE) {
+		rec.type = VMMCI_RECORD_COMMAND;
+		rec.cmd = cmd;
+		rec.real_ns = ktime_get_real_ns();
+		rec.boot_ns = ktime_to_ns(ktime_get_boottime());
+		rec.flags = polled ? VMMCI_RECORD_F_POLLED : 0;
+		vmmci_push_record(vmmci->records, &rec);
+
+		if (polled) {
+			vmmci->polled_cmds++;
+			vmmci->irq_state = VMMCI_IRQ_SUSPECT;
+		} else {
+			vmmci->irq_cmds++;
+			vmmci->irq_state = VMMCI_IRQ_CONFIRMED;
+		}
+	}
+
+	switch (cmd) {
+	case VMMCI_NONE:
+		debug("VMMCI_NONE received\n");
+		break;
+
+	case VMMCI_SHUTDOWN:
+		log("shutdown requested by host!\n");
+		vmmci_persist_phase(vmmci->records,
+		    VMMCI_SHUTDOWN_REQUESTED);
+		set_bit(cmd, &vmmci->pending_cmds);
+		schedule_work(&vmmci->cmd_work);
+		break;
+
+	case VMMCI_REBOOT:
+		log("reboot requested by host!\n");
+		vmmci_persist_phase(vmmci->records,
+		    VMMCI_SHUTDOWN_REQUESTED);
+		set_bit(cmd, &vmmci->pending_cmds);
+		schedule_work(&vmmci->cmd_work);
+		break;
+
+	case VMMCI_SYNCRTC:
+		log("clock sync requested by host\n");
+		set_bit(cmd, &vmmci->pending_cmds);
+		schedule_work(&vmmci->cmd_work);
+		break;
+
+	default:
+		printk(KERN_ERR "invalid command received: 0x%04x\n", cmd);
+		break;
+	}
+
+	if (cmd != VMMCI_NONE && virtio_has_feature(vdev, VMMCI_F_ACK)) {
+		vmmci_cwrite(vmmci, VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
+		debug("...acknowledged command %d\n", cmd);
+	}
+	spin_unlock_irqrestore(&vmmci->cmd_lock, flags);
+
+	if (cmd == VMMCI_NONE)
+		return;
+
+	if (polled)
+		printk(KERN_WARNING "vmmci: command %d only found by polling, "
+		    "config change interrupts may be broken\n", cmd);
+	else
+		vmmci_bench_cmd(vmmci, ktime_get_raw_ns() - start,
+		    atomic64_read(&vmmci->exits) - exits);
+}
+
+static void vmmci_changed(struct virtio_device *vdev)
+{
+	vmmci_handle_cmd(vdev->priv, false);
+}
+
+/* Looks for a command the interrupt handler should have picked up, giving
+ * one we've just spotted a moment for its interrupt to land. Returns how
+ * long until we should look again, in ms. When interrupts work this costs
+ * a single register read (one vm exit) per poll.
+ */
+static unsigned int vmmci_poll_cmd(struct virtio_vmmci *vmmci)
+{
+	s32 cmd = 0;
+
+	vmmci->polls++;
+	if (vmmci->poll_grace) {
+		vmmci->poll_grace = false;
+		vmmci_handle_cmd(vmmci, true);
+	} else {
+		vmmci_cread(vmmci, VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
+		if (cmd != VMMCI_NONE && cmd != READ_ONCE(vmmci->last_cmd)) {
+			vmmci->poll_grace = true;
+			return VMMCI_POLL_GRACE_MS;
+		}
+	}
+
+	switch (READ_ONCE(vmmci->irq_state)) {
+	case VMMCI_IRQ_CONFIRMED:
+		return VMMCI_POLL_SLOW_MS;
+	case VMMCI_IRQ_SUSPECT:
+		return VMMCI_POLL_FAST_MS;
+	default:
+		// Most guests never get a command at all
+		return vmmci->polls >= VMMCI_POLL_IDLE ? VMMCI_POLL_SLOW_MS
+		    : VMMCI_POLL_MS;
+	}
+}
+
+static void poll_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+
+	vmmci = container_of(to_delayed_work(work), struct virtio_vmmci,
+	    poll_work);
+	queue_delayed_work(system_power_efficient_wq, &vmmci->poll_work,
+	    msecs_to_jiffies(vmmci_poll_cmd(vmmci)));
+}
+
+/* Without acks the host never clears SYNCRTC from the command register,
+ * so we'd have no way to tell a new one from an old one.
+ */
+static void vmmci_start_poll(struct virtio_vmmci *vmmci)
+{
+	if (!cmd_poll || !virtio_has_feature(vmmci->vdev, VMMCI_F_ACK))
+		return;
+
+	queue_delayed_work(system_power_efficient_wq, &vmmci->poll_work,
+	    msecs_to_jiffies(VMMCI_POLL_MS));
+}
+
+static int vmmci_probe(struct virtio_device *vdev)
+{
+	struct virtio_vmmci *vmmci;
+	s64 windows[VMMCI_STAB_WINDOWS];
+#ifndef MODULE
+	bool late;
+#endif
+	int i;
+
+	debug("initializing vmmci device\n");
+	debug("HZ: %d", HZ);
+	vdev->priv = vmmci = kzalloc(sizeof(*vmmci), GFP_KERNEL);
+	if (!vmmci) {
+		printk(KERN_ERR "vmmci_probe: failed to alloc vmmci struct\n");
+		return -ENOMEM;
+	}
+	vmmci->vdev = vdev;
+	spin_lock_init(&vmmci->history_lock);
+	spin_lock_init(&vmmci->bench_lock);
+	spin_lock_init(&vmmci->cmd_lock);
+	mutex_init(&vmmci->sync_lock);
+	vmmci->regs_source.name = "vmmci";
+	vmmci->sources = &vmmci_sources;
+	vmmci->records = &records;
+
+	for (i = 0; i < mtie_windows_n; i++)
+		windows[i] = (s64) mtie_windows_s[i] * NSEC_PER_SEC;
+	vmmci_stab_init(&vmmci->stab, windows, mtie_windows_n);
+
+	if (virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
+		debug("...found feature TIMESYNC\n");
+	if (virtio_has_feature(vdev, VMMCI_F_ACK))
+		debug("...found feature ACK\n");
+	if (virtio_has_feature(vdev, VMMCI_F_SYNCRTC))
+		debug("...found feature SYNCRTC\n");
+
+	// wire up routine clock drift monitoring
+	vmmci->monitor_wq = create_singlethread_workqueue(QNAME_MONITOR);
+	if (vmmci->monitor_wq == NULL) {
+		printk(KERN_ERR "vmmci_probe: failed to alloc monitoring workqueue\n");
+		return -ENOMEM;
+	}
+
+	INIT_DELAYED_WORK(&vmmci->monitor_work, monitor_work_func);
+	INIT_WORK(&vmmci->sync_work, sync_work_func);
+	INIT_WORK(&vmmci->cmd_work, cmd_work_func);
+	INIT_DELAYED_WORK(&vmmci->poll_work, poll_work_func);
+	INIT_DELAYED_WORK(&vmmci->stale_work, stale_work_func);
+
+	vmmci->debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("samples", 0444, vmmci->debugfs, vmmci,
+	    &samples_fops);
+	debugfs_create_file("notifiers", 0444, vmmci->debugfs, NULL,
+	    &notifiers_fops);
+	debugfs_create_file("bench", 0600, vmmci->debugfs, vmmci,
+	    &bench_fops);
+	debugfs_create_file("commands", 0444, vmmci->debugfs, vmmci,
+	    &commands_fops);
+	debugfs_create_file("stability", 0444, vmmci->debugfs, vmmci,
+	    &stability_fops);
+	debugfs_create_file("sources", 0444, vmmci->debugfs, vmmci,
+	    &sources_fops);
+	debugfs_create_file("previous", 0444, vmmci->debugfs, NULL,
+	    &previous_fops);
+	debugfs_create_file("state", 0600, vmmci->debugfs, vmmci,
+	    &state_fops);
+
+	// Pick up where the last instance of the driver left off, if it
+	// left anything that still applies
+	if (persist.state && persist.state->magic == VMMCI_STATE_MAGIC) {
+		int rc = vmmci_state_load(vmmci, persist.state);
+
+		if (rc)
+			log("not restoring saved estimator state (%d)\n", rc);
+		persist.state->magic = 0;
+	}
+
+#ifdef MODULE
+	// We were loaded after boot, so catch up on any drift right away
+	// rather than waiting on the first scheduled measurement.
+	if (vmmci_check_drift(vmmci))
+		vmmci_sync(vmmci);
+#else
+	// Built in, the boot time sync below takes care of it once the rtc
+	// has had its say, unless it already gave up on us.
+	mutex_lock(&vmmci_boot_lock);
+	boot_vmmci = vmmci;
+	late = boot_sync_missed;
+	mutex_unlock(&vmmci_boot_lock);
+	complete_all(&vmmci_probed);
+
+	if (late && vmmci_check_drift(vmmci))
+		vmmci_sync(vmmci);
+#endif
+	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, DELAY_20s);
+	vmmci_start_poll(vmmci);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+	vmmci_table_header = register_sysctl_table(&vmmci_table);
+#else
+	vmmci_table_header = register_sysctl_sz("vmmci", drift_table,
+	    ARRAY_SIZE(drift_table) - 1);
+#endif
+
+	log("started VMM Control Interface driver\n");
+	return 0;
+}
+
+static void vmmci_remove(struct virtio_device *vdev)
+{
+	struct virtio_vmmci *vmmci = vdev->priv;
+	int i;
+	debug("removing device\n");
+
+#ifndef MODULE
+	mutex_lock(&vmmci_boot_lock);
+	boot_vmmci = NULL;
+	mutex_unlock(&vmmci_boot_lock);
+#endif
+
+	// Nothing from debugfs may queue work or touch vmmci past this point
+	debugfs_remove_recursive(vmmci->debugfs);
+
+	cancel_delayed_work(&vmmci->monitor_work);
+	flush_workqueue(vmmci->monitor_wq);
+	destroy_workqueue(vmmci->monitor_wq);
+	cancel_delayed_work_sync(&vmmci->poll_work);
+	cancel_delayed_work_sync(&vmmci->stale_work);
+	cancel_work_sync(&vmmci->cmd_work);
+	cancel_work_sync(&vmmci->sync_work);
+	debug("cancelled, flushed, and destroyed work queues\n");
+
+	// Leave our estimator state for the next instance of the driver
+	if (persist.state)
+		vmmci_state_save(vmmci, persist.state);
+
+	vmmci_publish_error(NULL);
+
+	vdev->config->reset(vdev);
+        debug("reset device\n");
+
+	for (i = 0; i < VMMCI_BENCH_OPS; i++) {
+		kvfree(vmmci->bench[i].ns);
+		kvfree(vmmci->bench[i].width);
+	}
+	kfree(vmmci);
+
+	unregister_sysctl_table(vmmci_table_header);
+
+	log("removed device\n");
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+static int vmmci_validate(struct virtio_device *vdev)
+{
+	debug("not implemented");
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_PM_SLEEP
+/* The virtio core has already disabled config change notifications by the
+ * time we get here, so all that's left is to stop our own work items.
+ */
+static int vmmci_freeze(struct virtio_device *vdev)
+{
+	struct virtio_vmmci *vmmci = vdev->priv;
+
+	debug("quiescing monitor, poll and sync work\n");
+	cancel_delayed_work_sync(&vmmci->monitor_work);
+	cancel_delayed_work_sync(&vmmci->poll_work);
+	cancel_delayed_work_sync(&vmmci->stale_work);
+	cancel_work_sync(&vmmci->cmd_work);
+	cancel_work_sync(&vmmci->sync_work);
+
+	// We can't vouch for the clock until we've measured it again
+	vmmci_publish_error(NULL);
+
+	vdev->config->reset(vdev);
+	debug("reset device\n");
+
+	return 0;
+}
+
+/* Our clock is likely way off after a resume or hibernation restore, so
+ * rather than waiting on the next scheduled measurement (or a SYNCRTC from
+ * the host that may never come) we measure right away and resync if needed.
+ */
+static int vmmci_restore(struct virtio_device *vdev)
+{
+	struct virtio_vmmci *vmmci = vdev->priv;
+
+	virtio_device_ready(vdev);
+
+	if (vmmci_check_drift(vmmci))
+		schedule_work(&vmmci->sync_work);
+
+	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, DELAY_20s);
+	vmmci_start_poll(vmmci);
+	debug("restored device\n");
+
+	return 0;
+}
+#endif
+
+static struct virtio_driver virtio_vmmci_driver = {
+	.feature_table = features,
+	.feature_table_size = ARRAY_SIZE(features),
+	.driver.name = 	KBUILD_MODNAME,
+	.driver.owner = THIS_MODULE,
+	.id_table = 	id_table,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	.validate = 	vmmci_validate,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
+	.probe = 	vmmci_probe,
+	.remove = 	vmmci_remove,
+	.config_changed = vmmci_changed,
+#ifdef CONFIG_PM_SLEEP
+	.freeze = 	vmmci_freeze,
+	.restore = 	vmmci_restore,
+#endif
+};
+
+/* Says how the last boot's shutdown went, if it was asked for one */
+static void vmmci_persist_report(struct vmmci_persist *p)
+{
+	s64 *phase = p->shutdown_boot_ns;
+
+	if (phase[VMMCI_SHUTDOWN_REQUESTED] == 0)
+		return;
+
+	if (phase[VMMCI_SHUTDOWN_KERNEL])
+		log("last boot shut down %lld ms after the host asked\n",
+		    (phase[VMMCI_SHUTDOWN_KERNEL]
+		    - phase[VMMCI_SHUTDOWN_REQUESTED]) / NSEC_PER_MSEC);
+	else
+		log("last boot never finished shutting down, last heard from "
+		    "%lld ms after the host asked%s\n", (p->last_boot_ns
+		    - phase[VMMCI_SHUTDOWN_REQUESTED]) / NSEC_PER_MSEC,
+		    phase[VMMCI_SHUTDOWN_NOTIFIED] ? ""
+		    : " (still notifying subscribers)");
+}
+
+/* Maps the persistent region and, after keeping a copy of whatever the
+ * last boot left there, starts a fresh record of our own.
+ */
+static void vmmci_persist_init(void)
+{
+	struct vmmci_persist *p;
+	unsigned long flags;
+	size_t size = sizeof(*p);
+
+	if (pstore_addr == 0 || pstore_size == 0)
+		return;
+
+	if (pstore_size < size) {
+		printk(KERN_ERR "vmmci: persistent region needs %zu bytes\n",
+		    size);
+		return;
+	}
+	if (pstore_size >= size + sizeof(struct vmmci_state))
+		size += sizeof(struct vmmci_state);
+
+	// We're about to wipe it, so make sure it's really set aside for us
+	if (region_intersects(pstore_addr, size, IORESOURCE_SYSTEM_RAM,
+	    IORES_DESC_NONE) != REGION_DISJOINT) {
+		printk(KERN_ERR "vmmci: persistent region at 0x%lx overlaps "
+		    "system RAM\n", pstore_addr);
+		return;
+	}
+	if (!request_mem_region(pstore_addr, size, "vmmci")) {
+		printk(KERN_ERR "vmmci: persistent region at 0x%lx is busy\n",
+		    pstore_addr);
+		return;
+	}
+
+	p = memremap(pstore_addr, size, MEMREMAP_WB);
+	if (p == NULL) {
+		printk(KERN_ERR "vmmci: unable to map persistent region at "
+		    "0x%lx\n", pstore_addr);
+		release_mem_region(pstore_addr, size);
+		return;
+	}
+	persist.size = size;
+
+	if (p->magic == VMMCI_PERSIST_MAGIC
+	    && p->version == VMMCI_PERSIST_VERSION && p->size == sizeof(*p)) {
+		persist.prev = *p;
+		persist.have_prev = true;
+		vmmci_persist_report(&persist.prev);
+	}
+
+	memset(p, 0, sizeof(*p));
+	p->magic = VMMCI_PERSIST_MAGIC;
+	p->version = VMMCI_PERSIST_VERSION;
+	p->size = sizeof(*p);
+	p->loads = persist.have_prev ? persist.prev.loads + 1 : 1;
+	p->loaded_real_ns = ktime_get_real_ns();
+	p->last_boot_ns = ktime_to_ns(ktime_get_boottime());
+
+	if (size > sizeof(*p))
+		persist.state = (struct vmmci_state *) (p + 1);
+
+	spin_lock_irqsave(&records.lock, flags);
+	records.persist = p;
+	spin_unlock_irqrestore(&records.lock, flags);
+}
+
+static void vmmci_persist_exit(void)
+{
+	struct vmmci_persist *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&records.lock, flags);
+	p = records.persist;
+	records.persist = NULL;
+	persist.state = NULL;
+	spin_unlock_irqrestore(&records.lock, flags);
+
+	if (p) {
+		memunmap(p);
+		release_mem_region(pstore_addr, persist.size);
+	}
+}
+
+/* The last phase of shutting down we can see, whoever asked for it */
+static int vmmci_reboot_notify(struct notifier_block *nb,
+    unsigned long action, void *data)
+{
+	vmmci_persist_phase(&records, VMMCI_SHUTDOWN_KERNEL);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block vmmci_reboot_nb = {
+	.notifier_call = vmmci_reboot_notify,
+};
+
+static int __init vmmci_init(void)
+{
+	int rc;
+
+	vmmci_persist_init();
+	register_reboot_notifier(&vmmci_reboot_nb);
+	vmmci_policy_register();
+#ifdef VMMCI_RTC_DEVICE
+	vmmci_register_source(&vmmci_rtc_source);
+#endif
+
+	// Not fatal, the driver works fine without the record stream
+	if (misc_register(&records_dev))
+		printk(KERN_ERR "vmmci: failed to register /dev/%s\n",
+		    VMMCI_DEVICE_NAME);
+	else
+		have_records_dev = true;
+
+	rc = register_virtio_driver(&virtio_vmmci_driver);
+	if (rc) {
+		if (have_records_dev)
+			misc_deregister(&records_dev);
+#ifdef VMMCI_RTC_DEVICE
+		vmmci_unregister_source(&vmmci_rtc_source);
+#endif
+		unregister_reboot_notifier(&vmmci_reboot_nb);
+		vmmci_persist_exit();
+	}
+	return rc;
+}
+module_init(vmmci_init);
+
+static void __exit vmmci_exit(void)
+{
+	unregister_virtio_driver(&virtio_vmmci_driver);
+	if (have_records_dev)
+		misc_deregister(&records_dev);
+#ifdef VMMCI_RTC_DEVICE
+	vmmci_unregister_source(&vmmci_rtc_source);
+#endif
+	unregister_reboot_notifier(&vmmci_reboot_nb);
+	vmmci_persist_exit();
+}
+module_exit(vmmci_exit);
+
+#ifndef MODULE
+/* Make sure the clock is right before init starts so early services (like
+ * those checking certificates) don't see a stale clock. This runs after the
+ * rtc's hctosys late_initcall so it can't undo our more precise step, and
+ * we only wait a bounded amount of time on the asynchronous probe. A probe
+ * that finishes after that syncs the clock itself.
+ */
+static int __init vmmci_boot_sync(void)
+{
+	struct pci_dev *pci_dev;
+
+	// Don't hold up boot if we're not running under vmd(8) at all
+	pci_dev = pci_get_device(PCI_VENDOR_ID_OPENBSD,
+	    PCI_DEVICE_ID_OPENBSD_VMMCI, NULL);
+	if (pci_dev == NULL)
+		return 0;
+	pci_dev_put(pci_dev);
+
+	// With the transport as a module nothing can bind the device before
+	// init loads it, so waiting would only cost us the whole timeout
+	if (IS_BUILTIN(CONFIG_VIRTIO_PCI_OBSD))
+		wait_for_completion_timeout(&vmmci_probed,
+		    msecs_to_jiffies(boot_sync_timeout_ms));
+
+	// Either sync now or leave it to the probe once it gets there. The
+	// lock also keeps remove from freeing the device under us.
+	mutex_lock(&vmmci_boot_lock);
+	if (boot_vmmci == NULL) {
+		boot_sync_missed = true;
+		log("device not ready, deferring boot time clock sync to probe\n");
+	} else if (vmmci_check_drift(boot_vmmci)) {
+		vmmci_sync(boot_vmmci);
+	}
+	mutex_unlock(&vmmci_boot_lock);
+
+	return 0;
+}
+late_initcall_sync(vmmci_boot_sync);
+#endif
+
+#if IS_ENABLED(CONFIG_VIRTIO_VMMCI_KUNIT_TEST)
+#include "virtio_vmmci_test.c"
+#endif
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("OpenBSD VMM Control Interface");
+MODULE_AUTHOR("Dave Voutila <voutilad@gmail.com>");
+MODULE_SOFTDEP("pre: virtio_pci_obsd");
@@ -0,0 +1,953 @@
+/*
+ *  KUnit tests for the OpenBSD VMM control interface driver.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* This file is #included at the bottom of virtio_vmmci_main.c so the tests
+ * can get at the driver's static functions. Instead of a real vmd(8) device,
+ * a mock config space backend plays the host: it serves the command and
+ * time registers with an adjustable offset from our own clock and can be
+ * told to be slow, tear reads across a second rollover or send the same
+ * command twice.
+ *
+ * The tests run inside the real driver, so each mock device streams its
+ * records to a ring of its own and votes only between the sources a test
+ * gives it. Any module parameters or sysctls a test can change are put
+ * back afterwards.
+ */
+#include <kunit/test.h>
+#include <linux/delay.h>
+
+/* How a particular time register read should misbehave */
+enum mock_glitch {
+	MOCK_OK = 0,
+	MOCK_TORN,	/* TIME_SEC and TIME_USEC read either side of a rollover */
+};
+
+struct vmmci_mock {
+	struct virtio_device vdev;
+	struct virtio_config_ops ops;
+	struct virtio_vmmci vmmci;
+
+	s64 host_offset;			/* host less guest REALTIME */
+	unsigned int latency_ns[VMMCI_SAMPLE_READS];
+	enum mock_glitch glitch[VMMCI_SAMPLE_READS];
+	unsigned int reads;			/* TIME_SEC reads so far */
+	s64 latched_sec;			/* host time at last TIME_SEC */
+	s32 latched_nsec;
+
+	s32 cmd;
+	unsigned int acks;
+	unsigned int cmd_works;
+
+	struct vmmci_records records;
+	struct list_head sources;
+};
+
+static struct vmmci_mock *to_mock(struct virtio_device *vdev)
+{
+	return container_of(vdev, struct vmmci_mock, vdev);
+}
+
+static void mock_get(struct virtio_device *vdev, unsigned offset,
+    void *buf, unsigned len)
+{
+	struct vmmci_mock *mock = to_mock(vdev);
+	unsigned int read = mock->reads % VMMCI_SAMPLE_READS;
+	s64 val = 0;
+
+	switch (offset) {
+	case VMMCI_CONFIG_COMMAND:
+		val = mock->cmd;
+		break;
+
+	case VMMCI_CONFIG_TIME_SEC:
+		// Like vmd(8), latch the time on the seconds read
+		if (mock->latency_ns[read])
+			ndelay(mock->latency_ns[read]);
+		mock->latched_sec = div_s64_rem(ktime_get_real_ns()
+		    + mock->host_offset, NSEC_PER_SEC, &mock->latched_nsec);
+		val = mock->latched_sec;
+		// As if the host hadn't latched and we stalled between the
+		// two reads: the seconds were read just before the rollover
+		// into this second, the microseconds now, after it
+		if (mock->glitch[read] == MOCK_TORN)
+			val -= 1;
+		break;
+
+	case VMMCI_CONFIG_TIME_USEC:
+		val = mock->latched_nsec / NSEC_PER_USEC;
+		mock->reads++;
+		break;
+	}
+
+	memcpy(buf, &val, len);
+}
+
+static void mock_set(struct virtio_device *vdev, unsigned offset,
+    const void *buf, unsigned len)
+{
+	struct vmmci_mock *mock = to_mock(vdev);
+
+	// Writing the command back is an ack, which vmd(8) answers by
+	// clearing SYNCRTC. SHUTDOWN and REBOOT are left where they are.
+	if (offset == VMMCI_CONFIG_COMMAND) {
+		mock->acks++;
+		if (mock->cmd == VMMCI_SYNCRTC)
+			mock->cmd = VMMCI_NONE;
+	}
+}
+
+static int mock_finalize_features(struct virtio_device *vdev)
+{
+	return 0;
+}
+
+/* Stands in for the real command work so a test can't power us off */
+static void mock_cmd_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+
+	vmmci = container_of(work, struct virtio_vmmci, cmd_work);
+	container_of(vmmci, struct vmmci_mock, vmmci)->cmd_works++;
+}
+
+/* The policy tests are written against the default module parameters, and
+ * recording samples updates the drift sysctls
+ */
+static struct {
+	bool ntp_publish;
+	bool autostep;
+	bool consensus;
+	unsigned int sync_threshold_ms;
+	unsigned int autostep_threshold_ms;
+	unsigned int autostep_confirm;
+	unsigned int autostep_interval_s;
+	unsigned int slew_max_us;
+	int drift_sec;
+	int drift_nsec;
+	int maxerror_us;
+	int esterror_us;
+	int unsynced;
+} saved;
+
+static int vmmci_test_init(struct kunit *test)
+{
+	struct vmmci_mock *mock;
+
+	mock = kunit_kzalloc(test, sizeof(*mock), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mock);
+
+	mock->ops.get = mock_get;
+	mock->ops.set = mock_set;
+	mock->ops.finalize_features = mock_finalize_features;
+	mock->vdev.config = &mock->ops;
+	mock->vdev.dev.driver = &virtio_vmmci_driver.driver;
+	mock->vdev.features = BIT_ULL(VMMCI_F_TIMESYNC) | BIT_ULL(VMMCI_F_ACK)
+	    | BIT_ULL(VMMCI_F_SYNCRTC);
+	mock->vdev.priv = &mock->vmmci;
+
+	mock->vmmci.vdev = &mock->vdev;
+	spin_lock_init(&mock->vmmci.history_lock);
+	spin_lock_init(&mock->vmmci.bench_lock);
+	spin_lock_init(&mock->vmmci.cmd_lock);
+	mutex_init(&mock->vmmci.sync_lock);
+	mock->vmmci.regs_source.name = "vmmci";
+	INIT_WORK(&mock->vmmci.cmd_work, mock_cmd_work_func);
+
+	// Keep our records out of /dev/vmmci and the persistent region, and
+	// the sources other drivers registered out of our votes
+	spin_lock_init(&mock->records.lock);
+	init_waitqueue_head(&mock->records.wait);
+	mock->vmmci.records = &mock->records;
+	INIT_LIST_HEAD(&mock->sources);
+	mock->vmmci.sources = &mock->sources;
+
+	saved.ntp_publish = ntp_publish;
+	saved.autostep = autostep;
+	saved.consensus = consensus;
+	saved.sync_threshold_ms = sync_threshold_ms;
+	saved.autostep_threshold_ms = autostep_threshold_ms;
+	saved.autostep_confirm = autostep_confirm;
+	saved.autostep_interval_s = autostep_interval_s;
+	saved.slew_max_us = slew_max_us;
+	saved.drift_sec = drift_sec;
+	saved.drift_nsec = drift_nsec;
+	saved.maxerror_us = maxerror_us;
+	saved.esterror_us = esterror_us;
+	saved.unsynced = unsynced;
+
+	// Don't let the tests touch the real kernel NTP state
+	ntp_publish = false;
+	sync_threshold_ms = 1000;
+	autostep_threshold_ms = 5000;
+	autostep_confirm = 3;
+	autostep_interval_s = 300;
+	slew_max_us = 0;
+
+	test->priv = mock;
+	return 0;
+}
+
+static void vmmci_test_exit(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_bench none = { 0 };
+	int i;
+
+	flush_work(&mock->vmmci.cmd_work);
+	for (i = 0; i < VMMCI_BENCH_OPS; i++)
+		vmmci_bench_swap(&mock->vmmci, i, &none);
+
+	ntp_publish = saved.ntp_publish;
+	autostep = saved.autostep;
+	consensus = saved.consensus;
+	sync_threshold_ms = saved.sync_threshold_ms;
+	autostep_threshold_ms = saved.autostep_threshold_ms;
+	autostep_confirm = saved.autostep_confirm;
+	autostep_interval_s = saved.autostep_interval_s;
+	slew_max_us = saved.slew_max_us;
+	drift_sec = saved.drift_sec;
+	drift_nsec = saved.drift_nsec;
+	maxerror_us = saved.maxerror_us;
+	esterror_us = saved.esterror_us;
+	unsynced = saved.unsynced;
+}
+
+static void sample_tracks_host_offset(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+
+	mock->host_offset = 2500 * NSEC_PER_MSEC;
+	vmmci_take_sample(&mock->vmmci, &sample);
+
+	KUNIT_EXPECT_LE(test, abs(sample.offset - mock->host_offset),
+	    (s64) NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, sample.offset, sample.host - sample.guest.real);
+	KUNIT_EXPECT_GE(test, sample.width, 0LL);
+}
+
+static void sample_prefers_narrowest_bracket(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+
+	mock->latency_ns[0] = 400 * NSEC_PER_USEC;
+	mock->latency_ns[2] = 300 * NSEC_PER_USEC;
+	mock->latency_ns[3] = 200 * NSEC_PER_USEC;
+	vmmci_take_sample(&mock->vmmci, &sample);
+
+	KUNIT_EXPECT_LT(test, sample.width, 200LL * NSEC_PER_USEC);
+}
+
+static void sample_rejects_torn_read(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+	int i;
+
+	// Make the torn read the most tempting one
+	for (i = 0; i < VMMCI_SAMPLE_READS; i++)
+		mock->latency_ns[i] = 200 * NSEC_PER_USEC;
+	mock->latency_ns[1] = 0;
+	mock->glitch[1] = MOCK_TORN;
+	vmmci_take_sample(&mock->vmmci, &sample);
+
+	KUNIT_EXPECT_LE(test, abs(sample.offset), (s64) NSEC_PER_MSEC);
+}
+
+static void sample_rejects_second_rollover(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+
+	mock->glitch[0] = MOCK_TORN;
+	mock->glitch[3] = MOCK_TORN;
+	vmmci_take_sample(&mock->vmmci, &sample);
+
+	KUNIT_EXPECT_LE(test, abs(sample.offset), (s64) NSEC_PER_MSEC);
+}
+
+static void sample_records_all_clocks(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+
+	vmmci_take_sample(&mock->vmmci, &sample);
+
+	KUNIT_EXPECT_GT(test, sample.guest.mono, 0LL);
+	KUNIT_EXPECT_GT(test, sample.guest.raw, 0LL);
+	KUNIT_EXPECT_GE(test, sample.guest.boot, sample.guest.mono);
+	KUNIT_EXPECT_GT(test, sample.guest.real, sample.guest.boot);
+}
+
+static void clock_jump_needs_sync(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	KUNIT_EXPECT_FALSE(test, vmmci_check_drift(&mock->vmmci));
+	KUNIT_EXPECT_EQ(test, unsynced, 0);
+
+	mock->host_offset = 30 * NSEC_PER_SEC;
+	KUNIT_EXPECT_TRUE(test, vmmci_check_drift(&mock->vmmci));
+	KUNIT_EXPECT_EQ(test, unsynced, 1);
+
+	mock->host_offset = -30 * NSEC_PER_SEC;
+	KUNIT_EXPECT_TRUE(test, vmmci_check_drift(&mock->vmmci));
+}
+
+static void sync_threshold_is_exclusive(struct kunit *test)
+{
+	struct vmmci_sample sample = { 0 };
+	s64 threshold = (s64) sync_threshold_ms * NSEC_PER_MSEC;
+
+	sample.offset = threshold;
+	KUNIT_EXPECT_FALSE(test, vmmci_needs_sync(&sample));
+	sample.offset = -threshold;
+	KUNIT_EXPECT_FALSE(test, vmmci_needs_sync(&sample));
+	sample.offset = threshold + 1;
+	KUNIT_EXPECT_TRUE(test, vmmci_needs_sync(&sample));
+}
+
+static void suspend_outlives_drift_samples(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+	s64 gap;
+
+	vmmci_take_sample(&mock->vmmci, &sample);
+	vmmci_record_drift(&mock->vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci_sleep_gap(&mock->vmmci, &sample), 0LL);
+
+	// The host sleeps for 30s and the drift monitor gets a sample in
+	// before the host's SYNCRTC
+	mock->host_offset = 30 * NSEC_PER_SEC;
+	vmmci_take_sample(&mock->vmmci, &sample);
+	vmmci_record_drift(&mock->vmmci, &sample);
+
+	vmmci_take_sample(&mock->vmmci, &sample);
+	gap = vmmci_sleep_gap(&mock->vmmci, &sample);
+	KUNIT_EXPECT_LE(test, abs(gap - mock->host_offset),
+	    (s64) NSEC_PER_MSEC);
+}
+
+static void error_bounds_follow_sample(struct kunit *test)
+{
+	struct vmmci_sample sample = { 0 };
+
+	sample.offset = -1500 * NSEC_PER_USEC;
+	sample.width = 200 * NSEC_PER_USEC;
+	vmmci_publish_error(&sample);
+
+	KUNIT_EXPECT_EQ(test, esterror_us, 1500);
+	KUNIT_EXPECT_EQ(test, maxerror_us, 1601);
+	KUNIT_EXPECT_EQ(test, unsynced, 0);
+
+	vmmci_publish_error(NULL);
+	KUNIT_EXPECT_EQ(test, maxerror_us, NTP_PHASE_LIMIT);
+	KUNIT_EXPECT_EQ(test, unsynced, 1);
+}
+
+/* Runs a series of offsets (in seconds, one second apart) through the
+ * autostep policy and checks each verdict.
+ */
+static void expect_autostep(struct kunit *test, struct vmmci_autostep *st,
+    s64 start, const int *offsets, const enum vmmci_autostep_verdict *want,
+    int n)
+{
+	struct vmmci_core_params p;
+	int i;
+
+	// Armed regardless of the autostep module parameter
+	vmmci_params(&p);
+	p.autostep_threshold = (s64) autostep_threshold_ms * NSEC_PER_MSEC;
+
+	for (i = 0; i < n; i++) {
+		KUNIT_EXPECT_EQ_MSG(test, vmmci_core_autostep(&p, st,
+		    offsets[i] * NSEC_PER_SEC, start + i * NSEC_PER_SEC),
+		    want[i], "sample %d", i);
+	}
+}
+
+static void autostep_confirms_before_stepping(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	const int offsets[] = { 6, 6, -6 };
+	const enum vmmci_autostep_verdict want[] = {
+		VMMCI_AUTOSTEP_SUSPECT, VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_STEP,
+	};
+
+	expect_autostep(test, &st, 0, offsets, want, ARRAY_SIZE(offsets));
+}
+
+static void autostep_has_hysteresis(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	const int offsets[] = { 4, 6, 4, 6, 1, 6 };
+	const enum vmmci_autostep_verdict want[] = {
+		VMMCI_AUTOSTEP_IDLE,	/* under threshold, not suspicious */
+		VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_IDLE,	/* in the band, keeps the count */
+		VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_IDLE,	/* under half, stands down */
+		VMMCI_AUTOSTEP_SUSPECT,	/* and starts over */
+	};
+
+	expect_autostep(test, &st, 0, offsets, want, ARRAY_SIZE(offsets));
+	KUNIT_EXPECT_EQ(test, st.confirmed, 1U);
+}
+
+static void autostep_band_is_not_suspicious(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	const int offsets[] = { 6, 4, 4, 4, 6, 6 };
+	const enum vmmci_autostep_verdict want[] = {
+		VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_IDLE,	/* no more fast sampling for these */
+		VMMCI_AUTOSTEP_IDLE,
+		VMMCI_AUTOSTEP_IDLE,
+		VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_STEP,	/* three over, band in between */
+	};
+
+	expect_autostep(test, &st, 0, offsets, want, ARRAY_SIZE(offsets));
+}
+
+static void autostep_is_rate_limited(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	const int offsets[] = { 6, 6, 6, 6, 6, 6 };
+	const enum vmmci_autostep_verdict want[] = {
+		VMMCI_AUTOSTEP_SUSPECT, VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_STEP,
+		VMMCI_AUTOSTEP_SUSPECT, VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_IDLE,	/* confirmed again, but too soon */
+	};
+	const enum vmmci_autostep_verdict later[] = {
+		VMMCI_AUTOSTEP_STEP,
+	};
+
+	expect_autostep(test, &st, 0, offsets, want, ARRAY_SIZE(offsets));
+	expect_autostep(test, &st, (s64) autostep_interval_s * NSEC_PER_SEC
+	    + 2 * NSEC_PER_SEC, offsets, later, ARRAY_SIZE(later));
+}
+
+static void autostep_band_never_steps(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	const int offsets[] = { 6, 6, 6, 6, 6, 6 };
+	const int band[] = { 4 };
+	const enum vmmci_autostep_verdict want[] = {
+		VMMCI_AUTOSTEP_SUSPECT, VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_STEP,
+		VMMCI_AUTOSTEP_SUSPECT, VMMCI_AUTOSTEP_SUSPECT,
+		VMMCI_AUTOSTEP_IDLE,	/* confirmed again, but too soon */
+	};
+	const enum vmmci_autostep_verdict idle[] = {
+		VMMCI_AUTOSTEP_IDLE,
+	};
+
+	// Once the rate limit lifts, only a sample over threshold may step
+	expect_autostep(test, &st, 0, offsets, want, ARRAY_SIZE(offsets));
+	expect_autostep(test, &st, (s64) autostep_interval_s * NSEC_PER_SEC
+	    + 2 * NSEC_PER_SEC, band, idle, ARRAY_SIZE(idle));
+	KUNIT_EXPECT_TRUE(test, st.last_step < NSEC_PER_SEC * 3);
+}
+
+static void command_is_acked_once_per_delivery(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	mock->cmd = VMMCI_SYNCRTC;
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+
+	KUNIT_EXPECT_EQ(test, mock->acks, 1U);
+	KUNIT_EXPECT_EQ(test, mock->cmd, VMMCI_NONE);
+	KUNIT_EXPECT_EQ(test, mock->cmd_works, 1U);
+	KUNIT_EXPECT_TRUE(test, test_bit(VMMCI_SYNCRTC,
+	    &mock->vmmci.pending_cmds));
+}
+
+static void duplicate_commands_coalesce(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	mock->cmd = VMMCI_SYNCRTC;
+	vmmci_changed(&mock->vdev);
+	mock->cmd = VMMCI_SYNCRTC;
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+
+	// Both deliveries get acked, but there's only one sync pending
+	KUNIT_EXPECT_EQ(test, mock->acks, 2U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.pending_cmds, BIT(VMMCI_SYNCRTC));
+}
+
+static void shutdown_is_handled_once(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	int i;
+
+	// The host leaves SHUTDOWN in the register after our ack
+	mock->cmd = VMMCI_SHUTDOWN;
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+	KUNIT_EXPECT_EQ(test, mock->cmd, VMMCI_SHUTDOWN);
+
+	for (i = 0; i < 4; i++)
+		KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+		    VMMCI_POLL_SLOW_MS);
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+
+	KUNIT_EXPECT_EQ(test, mock->acks, 1U);
+	KUNIT_EXPECT_EQ(test, mock->cmd_works, 1U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.irq_cmds, 1ULL);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.polled_cmds, 0ULL);
+}
+
+static void polled_shutdown_is_handled_once(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	int i;
+
+	// Lost interrupt: the poller finds it, then keeps seeing it
+	mock->cmd = VMMCI_SHUTDOWN;
+	vmmci_poll_cmd(&mock->vmmci);
+	vmmci_poll_cmd(&mock->vmmci);
+	for (i = 0; i < 4; i++)
+		vmmci_poll_cmd(&mock->vmmci);
+	flush_work(&mock->vmmci.cmd_work);
+
+	KUNIT_EXPECT_EQ(test, mock->acks, 1U);
+	KUNIT_EXPECT_EQ(test, mock->cmd_works, 1U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.polled_cmds, 1ULL);
+	KUNIT_EXPECT_FALSE(test, mock->vmmci.poll_grace);
+}
+
+static void no_command_is_not_acked(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+
+	KUNIT_EXPECT_EQ(test, mock->acks, 0U);
+	KUNIT_EXPECT_EQ(test, mock->cmd_works, 0U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.pending_cmds, 0UL);
+}
+
+static void sample_counts_exits(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample;
+
+	// Each read is TIME_SEC (64 bits, so two exits) then TIME_USEC
+	vmmci_take_sample(&mock->vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&mock->vmmci.exits),
+	    (s64) VMMCI_SAMPLE_READS * 3);
+}
+
+static void poll_catches_lost_command(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci), VMMCI_POLL_MS);
+
+	// The interrupt gets a grace period, then polling takes over
+	mock->cmd = VMMCI_SHUTDOWN;
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_GRACE_MS);
+	KUNIT_EXPECT_EQ(test, mock->acks, 0U);
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_FAST_MS);
+	flush_work(&mock->vmmci.cmd_work);
+
+	KUNIT_EXPECT_EQ(test, mock->acks, 1U);
+	KUNIT_EXPECT_EQ(test, mock->cmd_works, 1U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.polled_cmds, 1ULL);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.irq_state, VMMCI_IRQ_SUSPECT);
+}
+
+static void idle_poll_backs_off(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	mock->vmmci.polls = VMMCI_POLL_IDLE - 2;
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci), VMMCI_POLL_MS);
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_SLOW_MS);
+
+	// A lost command still brings the fast rate back
+	mock->cmd = VMMCI_SHUTDOWN;
+	vmmci_poll_cmd(&mock->vmmci);
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_FAST_MS);
+	flush_work(&mock->vmmci.cmd_work);
+}
+
+static void interrupt_beats_poll(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+
+	mock->cmd = VMMCI_SYNCRTC;
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_GRACE_MS);
+	vmmci_changed(&mock->vdev);
+	KUNIT_EXPECT_EQ(test, vmmci_poll_cmd(&mock->vmmci),
+	    VMMCI_POLL_SLOW_MS);
+	flush_work(&mock->vmmci.cmd_work);
+
+	// Handled once, by the interrupt
+	KUNIT_EXPECT_EQ(test, mock->acks, 1U);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.irq_cmds, 1ULL);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.polled_cmds, 0ULL);
+	KUNIT_EXPECT_EQ(test, mock->vmmci.irq_state, VMMCI_IRQ_CONFIRMED);
+}
+
+static void persist_keeps_last_records(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_persist *p;
+	struct vmmci_sample sample;
+	s64 *phase;
+	int i;
+
+	p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p);
+	phase = p->shutdown_boot_ns;
+
+	mock->records.persist = p;
+
+	// Enough samples to wrap the ring
+	for (i = 0; i < VMMCI_PERSIST_SAMPLES + 2; i++) {
+		mock->host_offset = i * 100 * NSEC_PER_MSEC;
+		vmmci_take_sample(&mock->vmmci, &sample);
+		vmmci_record_drift(&mock->vmmci, &sample);
+	}
+	mock->cmd = VMMCI_SHUTDOWN;
+	vmmci_changed(&mock->vdev);
+	flush_work(&mock->vmmci.cmd_work);
+	vmmci_persist_phase(&mock->records, VMMCI_SHUTDOWN_KERNEL);
+
+	KUNIT_EXPECT_EQ(test, p->samples_next, VMMCI_PERSIST_SAMPLES + 2ULL);
+	KUNIT_EXPECT_EQ(test, p->samples[1].type, VMMCI_RECORD_SAMPLE);
+	KUNIT_EXPECT_LE(test, abs(p->samples[1].offset_ns
+	    - (VMMCI_PERSIST_SAMPLES + 1) * 100 * NSEC_PER_MSEC),
+	    (s64) NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, p->commands_next, 1ULL);
+	KUNIT_EXPECT_EQ(test, p->commands[0].type, VMMCI_RECORD_COMMAND);
+	KUNIT_EXPECT_EQ(test, p->commands[0].cmd, VMMCI_SHUTDOWN);
+
+	// The mock command work never notifies anyone
+	KUNIT_EXPECT_NE(test, phase[VMMCI_SHUTDOWN_REQUESTED], 0LL);
+	KUNIT_EXPECT_EQ(test, phase[VMMCI_SHUTDOWN_NOTIFIED], 0LL);
+	KUNIT_EXPECT_GE(test, phase[VMMCI_SHUTDOWN_KERNEL],
+	    phase[VMMCI_SHUTDOWN_REQUESTED]);
+	KUNIT_EXPECT_EQ(test, p->last_boot_ns, phase[VMMCI_SHUTDOWN_KERNEL]);
+}
+
+static void bench_times_armed_commands(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_bench *b = &mock->vmmci.bench[VMMCI_BENCH_CMD];
+	int i;
+
+	KUNIT_ASSERT_EQ(test, vmmci_bench_run(&mock->vmmci, VMMCI_BENCH_CMD,
+	    2), 0);
+	KUNIT_EXPECT_EQ(test, b->done, 0U);
+
+	for (i = 0; i < 3; i++) {
+		mock->cmd = VMMCI_SYNCRTC;
+		vmmci_changed(&mock->vdev);
+	}
+	vmmci_changed(&mock->vdev);
+
+	// Only the first two commands count, each a read and an ack
+	KUNIT_EXPECT_EQ(test, b->done, 2U);
+	KUNIT_EXPECT_EQ(test, b->exits, 4ULL);
+}
+
+static void decide_slews_small_offsets(struct kunit *test)
+{
+	struct vmmci_autostep st = { 0 };
+	struct vmmci_core_params p;
+
+	vmmci_params(&p);
+	KUNIT_EXPECT_EQ(test, vmmci_core_decide(&p, &st, 400 * NSEC_PER_USEC,
+	    0), VMMCI_CORE_NONE);
+
+	p.slew_max = 500 * NSEC_PER_USEC;
+	KUNIT_EXPECT_EQ(test, vmmci_core_decide(&p, &st, -400 * NSEC_PER_USEC,
+	    0), VMMCI_CORE_SLEW);
+	KUNIT_EXPECT_EQ(test, vmmci_core_decide(&p, &st, 600 * NSEC_PER_USEC,
+	    0), VMMCI_CORE_NONE);
+	KUNIT_EXPECT_EQ(test, vmmci_core_decide(&p, &st, 0, 0),
+	    VMMCI_CORE_NONE);
+}
+
+static void freq_tracks_host_rate(struct kunit *test)
+{
+	struct vmmci_core_point pts[VMMCI_HISTORY];
+	s64 ppb = 0;
+	int i;
+
+	// A host running 42 ppm fast, sampled every 20s with some jitter
+	for (i = 0; i < VMMCI_HISTORY; i++) {
+		pts[i].raw = 1000 * NSEC_PER_SEC + i * 20 * NSEC_PER_SEC;
+		pts[i].phase = 7 * NSEC_PER_SEC + i * 20 * 42000
+		    + (i % 3 - 1) * 500;
+	}
+	KUNIT_ASSERT_EQ(test, vmmci_core_freq(pts, VMMCI_HISTORY, &ppb), 0);
+	KUNIT_EXPECT_LE(test, abs(ppb - 42000), 10LL);
+
+	KUNIT_EXPECT_EQ(test, vmmci_core_freq(pts, 1, &ppb), -1);
+}
+
+static void freq_ignores_phase_steps(struct kunit *test)
+{
+	struct vmmci_core_point pts[VMMCI_HISTORY];
+	s64 ppb = 0;
+	int i;
+
+	// The same 42 ppm host, but suspended for an hour two thirds in,
+	// which is way past fitting across in 64 bits
+	for (i = 0; i < VMMCI_HISTORY; i++) {
+		pts[i].raw = 1000 * NSEC_PER_SEC + i * 20 * NSEC_PER_SEC;
+		pts[i].phase = 7 * NSEC_PER_SEC + i * 20 * 42000
+		    + (i % 3 - 1) * 500;
+		if (i >= 40)
+			pts[i].phase += 3600 * NSEC_PER_SEC;
+	}
+	KUNIT_ASSERT_EQ(test, vmmci_core_freq(pts, VMMCI_HISTORY, &ppb), 0);
+	KUNIT_EXPECT_LE(test, abs(ppb - 42000), 10LL);
+
+	// Nothing left to fit if the step was the last point
+	pts[VMMCI_HISTORY - 1].phase += 3600 * NSEC_PER_SEC;
+	KUNIT_EXPECT_EQ(test, vmmci_core_freq(pts, VMMCI_HISTORY, &ppb), -1);
+}
+
+static void stability_of_alternating_phase(struct kunit *test)
+{
+	struct vmmci_stab *s;
+	const s64 windows[] = { 60 * NSEC_PER_SEC };
+	s64 adev, tdev, x;
+	int i;
+
+	s = kunit_kzalloc(test, sizeof(*s), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, s);
+	vmmci_stab_init(s, windows, ARRAY_SIZE(windows));
+
+	// +/- 1us of phase every 20s on top of a steady 10 ppm
+	for (i = 0; i < 200; i++) {
+		x = (i % 2 ? 1000 : -1000);
+		vmmci_stab_add(s, i * 20 * NSEC_PER_SEC, i * 20 * 10000 + x, x);
+	}
+
+	KUNIT_EXPECT_EQ(test, vmmci_stab_tau0(s), 20 * NSEC_PER_SEC);
+	KUNIT_ASSERT_EQ(test, vmmci_stab_dev(s, 0, &adev, &tdev), 0);
+
+	// Second differences are all 4us, so ADEV = 4us / (root 2 * 20s),
+	// give or take the rms being rounded down to the ns
+	KUNIT_EXPECT_LE(test, abs(adev - 141421), 50LL);
+	KUNIT_EXPECT_EQ(test, s->mtie[0], 2000LL);
+}
+
+static void consensus_outvotes_falseticker(struct kunit *test)
+{
+	const s64 offsets[] = { 0, 300 * NSEC_PER_USEC, 10 * NSEC_PER_SEC };
+	const s64 errors[] = { NSEC_PER_SEC, NSEC_PER_MSEC, NSEC_PER_MSEC };
+	bool agree[3];
+	s64 lo, hi;
+
+	// The rtc's wide second takes in the registers, not the liar
+	KUNIT_EXPECT_EQ(test, vmmci_core_intersect(offsets, errors, 3, agree,
+	    &lo, &hi), 2);
+	KUNIT_EXPECT_TRUE(test, agree[0]);
+	KUNIT_EXPECT_TRUE(test, agree[1]);
+	KUNIT_EXPECT_FALSE(test, agree[2]);
+	KUNIT_EXPECT_EQ(test, lo, -700 * NSEC_PER_USEC);
+	KUNIT_EXPECT_EQ(test, hi, 1300 * NSEC_PER_USEC);
+
+	// Two sources that disagree can't outvote each other
+	KUNIT_EXPECT_EQ(test, vmmci_core_intersect(&offsets[1], &errors[1], 2,
+	    agree, &lo, &hi), 1);
+}
+
+static int fake_source_read(struct vmmci_source *src, s64 *offset,
+    s64 *error)
+{
+	*offset = 0;
+	*error = NSEC_PER_MSEC;
+	return 0;
+}
+
+static void registers_need_quorum_to_step(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_source a = { .name = "a", .read = fake_source_read };
+	struct vmmci_source b = { .name = "b", .read = fake_source_read };
+	struct vmmci_sample sample;
+
+	// Only our mock device votes with these two
+	list_add_tail(&a.node, &mock->sources);
+	list_add_tail(&b.node, &mock->sources);
+
+	mock->host_offset = 10 * NSEC_PER_SEC;
+	vmmci_take_sample(&mock->vmmci, &sample);
+	KUNIT_EXPECT_FALSE(test, vmmci_may_step(&mock->vmmci, &sample,
+	    &mock->vmmci.regs_source));
+	KUNIT_EXPECT_EQ(test, mock->vmmci.regs_source.health,
+	    VMMCI_SOURCE_FALSETICKER);
+	KUNIT_EXPECT_EQ(test, a.health, VMMCI_SOURCE_OK);
+
+	mock->host_offset = 0;
+	vmmci_take_sample(&mock->vmmci, &sample);
+	KUNIT_EXPECT_TRUE(test, vmmci_may_step(&mock->vmmci, &sample,
+	    &mock->vmmci.regs_source));
+}
+
+static void vetoed_step_is_not_rate_limited(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct vmmci_sample sample = { .offset = 10 * NSEC_PER_SEC };
+	unsigned int i;
+
+	autostep = true;
+	sample.outvoted = true;
+	for (i = 1; i < autostep_confirm; i++)
+		KUNIT_EXPECT_EQ(test, vmmci_monitor_decide(&mock->vmmci,
+		    &sample), VMMCI_CORE_SUSPECT);
+	KUNIT_EXPECT_EQ(test, vmmci_monitor_decide(&mock->vmmci, &sample),
+	    VMMCI_CORE_NONE);
+	KUNIT_EXPECT_FALSE(test, mock->vmmci.autostep.stepped);
+
+	// The falseticker clears up and the registers get their step
+	sample.outvoted = false;
+	sample.guest.boot += NSEC_PER_SEC;
+	KUNIT_EXPECT_EQ(test, vmmci_monitor_decide(&mock->vmmci, &sample),
+	    VMMCI_CORE_STEP);
+}
+
+static void state_survives_reload(struct kunit *test)
+{
+	struct vmmci_mock *mock = test->priv;
+	struct virtio_vmmci *vmmci = &mock->vmmci;
+	struct vmmci_sample sample;
+	struct vmmci_state *st;
+	int i;
+
+	st = kunit_kzalloc(test, sizeof(*st), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, st);
+
+	for (i = 0; i < 4; i++) {
+		vmmci_take_sample(vmmci, &sample);
+		vmmci_record_drift(vmmci, &sample);
+	}
+	vmmci_state_save(vmmci, st);
+	KUNIT_EXPECT_EQ(test, st->nsamples, 4U);
+
+	// As if we'd just been loaded again
+	vmmci->history_next = 0;
+	vmmci->have_last = false;
+	KUNIT_EXPECT_EQ(test, vmmci_state_load(vmmci, st), 0);
+	KUNIT_EXPECT_EQ(test, vmmci->history_next, 4U);
+	KUNIT_EXPECT_TRUE(test, vmmci->have_last);
+	KUNIT_EXPECT_EQ(test, vmmci->last.host, st->samples[3].host_ns);
+
+	// A damaged state is turned away
+	st->freq_ppb++;
+	KUNIT_EXPECT_EQ(test, vmmci_state_load(vmmci, st), -EBADMSG);
+	st->freq_ppb--;
+
+	// Nor does it apply once the host clock has jumped
+	mock->host_offset = NSEC_PER_SEC;
+	KUNIT_EXPECT_EQ(test, vmmci_state_load(vmmci, st), -ESTALE);
+}
+
+static struct kunit_case vmmci_sampling_cases[] = {
+	KUNIT_CASE(sample_tracks_host_offset),
+	KUNIT_CASE(sample_prefers_narrowest_bracket),
+	KUNIT_CASE(sample_rejects_torn_read),
+	KUNIT_CASE(sample_rejects_second_rollover),
+	KUNIT_CASE(sample_records_all_clocks),
+	KUNIT_CASE(sample_counts_exits),
+	KUNIT_CASE(state_survives_reload),
+	{ },
+};
+
+static struct kunit_case vmmci_policy_cases[] = {
+	KUNIT_CASE(clock_jump_needs_sync),
+	KUNIT_CASE(sync_threshold_is_exclusive),
+	KUNIT_CASE(error_bounds_follow_sample),
+	KUNIT_CASE(suspend_outlives_drift_samples),
+	KUNIT_CASE(autostep_confirms_before_stepping),
+	KUNIT_CASE(autostep_has_hysteresis),
+	KUNIT_CASE(autostep_band_is_not_suspicious),
+	KUNIT_CASE(autostep_is_rate_limited),
+	KUNIT_CASE(autostep_band_never_steps),
+	KUNIT_CASE(decide_slews_small_offsets),
+	KUNIT_CASE(freq_tracks_host_rate),
+	KUNIT_CASE(freq_ignores_phase_steps),
+	KUNIT_CASE(stability_of_alternating_phase),
+	KUNIT_CASE(consensus_outvotes_falseticker),
+	KUNIT_CASE(registers_need_quorum_to_step),
+	KUNIT_CASE(vetoed_step_is_not_rate_limited),
+	{ },
+};
+
+static struct kunit_case vmmci_command_cases[] = {
+	KUNIT_CASE(command_is_acked_once_per_delivery),
+	KUNIT_CASE(duplicate_commands_coalesce),
+	KUNIT_CASE(shutdown_is_handled_once),
+	KUNIT_CASE(polled_shutdown_is_handled_once),
+	KUNIT_CASE(no_command_is_not_acked),
+	KUNIT_CASE(bench_times_armed_commands),
+	KUNIT_CASE(poll_catches_lost_command),
+	KUNIT_CASE(interrupt_beats_poll),
+	KUNIT_CASE(idle_poll_backs_off),
+	KUNIT_CASE(persist_keeps_last_records),
+	{ },
+};
+
+static struct kunit_suite vmmci_sampling_suite = {
+	.name = "vmmci-sampling",
+	.init = vmmci_test_init,
+	.exit = vmmci_test_exit,
+	.test_cases = vmmci_sampling_cases,
+};
+
+static struct kunit_suite vmmci_policy_suite = {
+	.name = "vmmci-policy",
+	.init = vmmci_test_init,
+	.exit = vmmci_test_exit,
+	.test_cases = vmmci_policy_cases,
+};
+
+static struct kunit_suite vmmci_command_suite = {
+	.name = "vmmci-command",
+	.init = vmmci_test_init,
+	.exit = vmmci_test_exit,
+	.test_cases = vmmci_command_cases,
+};
+
+kunit_test_suites(&vmmci_sampling_suite, &vmmci_policy_suite,
+    &vmmci_command_suite);
@@ -0,0 +1,130 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2020 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef _VIRTIO_VMMCI_UAPI_H
+#define _VIRTIO_VMMCI_UAPI_H
+
+/* Shared between the driver and userspace tools like vmmcid. Reading
+ * /dev/vmmci returns a stream of these records, oldest first. Reads block
+ * until a new record is available (unless opened O_NONBLOCK) and poll(2)
+ * works as you'd expect. A reader that falls too far behind skips ahead to
+ * the oldest record still buffered, which shows up as a gap in seq.
+ */
+#include <linux/types.h>
+
+#define VMMCI_DEVICE_NAME	"vmmci"
+
+enum vmmci_record_type {
+	VMMCI_RECORD_SAMPLE = 1,	/* an accepted drift sample */
+	VMMCI_RECORD_COMMAND,		/* a command received from the host */
+	VMMCI_RECORD_SYNC,		/* a finished clock sync */
+};
+
+/* Record flags */
+#define VMMCI_RECORD_F_POLLED	0x1	/* command found by polling, not irq */
+#define VMMCI_RECORD_F_OUTVOTED	0x2	/* sample other time sources disputed */
+
+/* All times are in ns. For samples, the guest clocks are taken at the same
+ * instant, offset is host less guest REALTIME and width is the size of the
+ * bracket around the host read. For syncs, offset is the step applied,
+ * width is the remaining error bound and duration is how long it took.
+ */
+struct vmmci_record {
+	__u32 type;
+	__u32 cmd;
+	__u64 seq;
+	__s64 host_ns;
+	__s64 real_ns;
+	__s64 mono_ns;
+	__s64 raw_ns;
+	__s64 boot_ns;
+	__u64 cycles;
+	__s64 offset_ns;
+	__s64 width_ns;
+	__s64 duration_ns;
+	__s32 result;
+	__u32 flags;
+};
+
+/* The layout of the persistent region (see the pstore_addr parameter). It
+ * keeps the last few records of each kind, written as they're streamed,
+ * plus when each phase of the last shutdown was reached, so that a guest
+ * killed mid-shutdown or booted with a bad clock can be looked into after
+ * the fact. All boot_ns times are CLOCK_BOOTTIME of the boot that wrote
+ * them.
+ */
+#define VMMCI_PERSIST_MAGIC	0x564d4d43	/* "VMMC" */
+#define VMMCI_PERSIST_VERSION	1
+#define VMMCI_PERSIST_SAMPLES	8
+#define VMMCI_PERSIST_COMMANDS	16
+
+enum vmmci_shutdown_phase {
+	VMMCI_SHUTDOWN_REQUESTED = 0,	/* SHUTDOWN or REBOOT received */
+	VMMCI_SHUTDOWN_NOTIFIED,	/* subscribers done, handed to init */
+	VMMCI_SHUTDOWN_KERNEL,		/* userspace done, kernel going down */
+	VMMCI_SHUTDOWN_PHASES,
+};
+
+struct vmmci_persist {
+	__u32 magic;
+	__u32 version;
+	__u32 size;
+	__u32 loads;		/* times the driver has loaded over it */
+	__s64 loaded_real_ns;
+	__s64 last_boot_ns;	/* when anything was last written */
+	__u64 samples_next;
+	__u64 commands_next;
+	struct vmmci_record samples[VMMCI_PERSIST_SAMPLES];
+	struct vmmci_record commands[VMMCI_PERSIST_COMMANDS];
+	struct vmmci_record sync;
+	__s64 shutdown_boot_ns[VMMCI_SHUTDOWN_PHASES];	/* 0 if not reached */
+};
+
+/* The drift estimator's state, handed from one instance of the driver to
+ * the next so an upgrade or reload doesn't start over. It's read from and
+ * written to /sys/kernel/debug/virtio_vmmci/state, and also kept in the
+ * persistent region (if it's big enough) on remove. Samples are oldest
+ * first. A state is only taken back in the same boot, on the same
+ * clocksource and against the same host clock that it was saved from.
+ */
+#define VMMCI_STATE_MAGIC	0x564d5354	/* "VMST" */
+#define VMMCI_STATE_VERSION	1
+#define VMMCI_STATE_SAMPLES	64
+
+struct vmmci_state {
+	__u32 magic;
+	__u32 version;
+	__u32 size;
+	__u32 csum;		/* crc32 of the state with this zeroed */
+	__s64 saved_real_ns;
+	__s64 saved_boot_ns;
+	__s64 saved_raw_ns;
+	__u32 cs_seq;		/* clocksource changes when saved */
+	__u32 nsamples;
+	__s64 freq_ppb;
+	__u32 have_freq;
+	__u32 autostep_confirmed;
+	__s64 autostep_last_step;	/* CLOCK_BOOTTIME */
+	__u32 autostep_stepped;
+	__u32 pad;
+	struct vmmci_record samples[VMMCI_STATE_SAMPLES];
+};
+
+#endif // _VIRTIO_VMMCI_UAPI_H